@@ -0,0 +1,459 @@
+#ifndef DBASYNC_H_
+#define DBASYNC_H_
+
+/*
+ * 异步 mysql: MariaDB 的非阻塞接口 mysql_xxx_start/_cont + redis_async 的 epoll reactor，
+ * 一个线程在多个连接上同时跑查询，并发数等于连接数而不是线程数。
+ * 需要 MariaDB Connector/C(libmariadb)，MySQL 官方的 libmysqlclient 没有 _start/_cont。
+ * 和 redis_async/adapter.h 一样整个实现都在头文件里，reactor.h 里的函数不是 inline 的，只能被一个 .cpp 包含。
+ * 没有定时器，不处理 MYSQL_WAIT_TIMEOUT，连接和查询超时要在外面自己判断。
+ * 连不上的连接按退避时间在新任务到来时重连，退避期间所有连接都连不上时任务直接失败。
+ * 用法见 test_async.cpp
+ */
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <errmsg.h>
+
+#include "DBPool.h"
+#include "reactor.h"
+
+#define DB_ASYNC_RETRY_MIN_MS	100		// 连不上之后第一次重连的退避时间，之后每次翻倍
+#define DB_ASYNC_RETRY_MAX_MS	10000
+
+// result_set: select 的结果，其他语句是 NULL，回调返回后释放
+// err: 0 成功，否则是 mysql_errno
+typedef void (*DBAsyncCallback)(CResultSet *result_set, int err, void *privdata);
+
+class CDBAsyncPool {
+public:
+	CDBAsyncPool(reactor_t *r, const char *pool_name, const char *db_server_ip, uint16_t db_server_port,
+				 const char *username, const char *password, const char *db_name, int conn_cnt);
+	virtual ~CDBAsyncPool();
+
+	int Init();		// 开始建立 conn_cnt 个非阻塞连接，在事件循环里完成
+	// 排队执行，有空闲连接马上发出去。回调在事件循环线程里调用，回调里可以继续 Query
+	void Query(const char *sql_query, DBAsyncCallback cb, void *privdata);
+
+	int GetPending() { return (int)m_tasks.size() + m_busy; }	// 排队的加上正在执行的
+	const char *GetPoolName() { return m_pool_name.c_str(); }
+private:
+	enum { CONN_CONNECT, CONN_IDLE, CONN_QUERY, CONN_STORE, CONN_DEAD };
+
+	struct Task {
+		string			sql;
+		DBAsyncCallback	cb;
+		void*			privdata;
+	};
+
+	struct Conn {
+		event_t			e;		// 必须是第一个成员，事件回调里 event_t* 转回 Conn*
+		CDBAsyncPool*	pool;
+		MYSQL*			mysql;
+		MYSQL*			ret_mysql;	// mysql_real_connect 的返回值
+		MYSQL_RES*		res;
+		Task*			task;	// 正在执行的
+		int				state;
+		int				ret;	// mysql_real_query 的返回值
+		int				wait;	// 在等的 MYSQL_WAIT_xxx
+		int				mask;	// 注册到 epoll 的事件，0 表示没有注册
+		bool			retried;	// 断线重连过一次了
+		uint32_t		backoff_ms;	// 连续连不上时的退避时间，连上后清零
+		uint64_t		retry_at;	// CONN_DEAD 时，这个时间之后有新任务才重连
+	};
+
+	static void _OnEvent(int fd, int events, void *privdata);
+	void _Open(Conn *c);
+	void _Run(Conn *c, int ready);
+	void _Wait(Conn *c, int status);
+	void _Finish(Conn *c, MYSQL_RES *res, int err);
+	void _FailAll();
+	bool _Alive();
+	void _SetDead(Conn *c);
+	void _Revive();
+	static uint64_t _NowMs();
+
+	reactor_t*		m_reactor;
+	string 			m_pool_name;
+	string 			m_db_server_ip;
+	uint16_t		m_db_server_port;
+	string 			m_username;
+	string 			m_password;
+	string 			m_db_name;
+	int				m_conn_cnt;
+	int				m_busy = 0;		// 正在执行的任务数
+	bool			m_failing = false;	// 正在 _FailAll 里回调
+	vector<Conn*>	m_conns;
+	vector<Conn*>	m_idle;		// 空闲的连接
+	deque<Task*>	m_tasks;	// 还没有发出去的
+};
+
+CDBAsyncPool::CDBAsyncPool(reactor_t *r, const char *pool_name, const char *db_server_ip, uint16_t db_server_port,
+						   const char *username, const char *password, const char *db_name, int conn_cnt)
+{
+	m_reactor = r;
+	m_pool_name = pool_name;
+	m_db_server_ip = db_server_ip;
+	m_db_server_port = db_server_port;
+	m_username = username;
+	m_password = password;
+	m_db_name = db_name;
+	m_conn_cnt = conn_cnt;
+}
+
+CDBAsyncPool::~CDBAsyncPool()
+{
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		Conn *c = m_conns[i];
+		if (c->mask)
+		{
+			del_event(m_reactor->epfd, c->e.fd);
+		}
+		if (c->res)
+		{
+			mysql_free_result(c->res);
+		}
+		if (c->mysql)
+		{
+			mysql_close(c->mysql);
+		}
+		delete c->task;		// 没有完成的不再回调
+		delete c;
+	}
+
+	if (!m_tasks.empty())
+	{
+		printf("db async pool: %s, drop %d tasks\n", m_pool_name.c_str(), (int)m_tasks.size());
+	}
+	for (size_t i = 0; i < m_tasks.size(); i++)
+	{
+		delete m_tasks[i];
+	}
+}
+
+int CDBAsyncPool::Init()
+{
+	for (int i = 0; i < m_conn_cnt; i++)
+	{
+		Conn *c = new Conn();
+		c->pool = this;
+		c->e.r = m_reactor;
+		c->e.read_fn = _OnEvent;
+		c->e.write_fn = _OnEvent;
+		m_conns.push_back(c);
+		_Open(c);
+		if (!c->mysql)
+		{
+			return 1;
+		}
+		_Run(c, 0);
+	}
+
+	return 0;
+}
+
+void CDBAsyncPool::Query(const char *sql_query, DBAsyncCallback cb, void *privdata)
+{
+	Task *task = new Task();
+	task->sql = sql_query;
+	task->cb = cb;
+	task->privdata = privdata;
+	m_tasks.push_back(task);
+
+	if (!m_idle.empty())
+	{
+		Conn *c = m_idle.back();
+		m_idle.pop_back();
+		_Run(c, 0);
+		return;
+	}
+
+	_Revive();
+	if (!_Alive())
+	{
+		_FailAll();		// 连接都断了，退避时间也没到
+	}
+}
+
+// 新建一个 MYSQL，下一步从 CONN_CONNECT 开始
+void CDBAsyncPool::_Open(Conn *c)
+{
+	if (c->mysql)
+	{
+		if (c->mask)
+		{
+			del_event(m_reactor->epfd, c->e.fd);
+			c->mask = 0;
+		}
+		mysql_close(c->mysql);
+	}
+
+	c->mysql = mysql_init(NULL);
+	if (!c->mysql)
+	{
+		printf("mysql_init failed\n");
+		_SetDead(c);
+		return;
+	}
+
+	mysql_options(c->mysql, MYSQL_OPT_NONBLOCK, 0);	// 打开非阻塞接口
+	mysql_options(c->mysql, MYSQL_SET_CHARSET_NAME, "utf8mb4");
+	c->state = CONN_CONNECT;
+}
+
+void CDBAsyncPool::_OnEvent(int fd, int events, void *privdata)
+{
+	((void)fd);
+	Conn *c = (Conn *)privdata;
+	int ready = 0;
+	if (events & EPOLLIN)
+		ready |= MYSQL_WAIT_READ;
+	if (events & EPOLLOUT)
+		ready |= MYSQL_WAIT_WRITE;
+
+	// 读写同时就绪时 reactor 会调两次，第二次等的可能已经不是这个事件了
+	ready &= c->wait;
+	if (ready)
+	{
+		c->pool->_Run(c, ready);
+	}
+}
+
+/*
+ * 连接的状态机。ready 为 0 时开始当前状态的操作(_start)，否则是等到的事件，继续操作(_cont)。
+ * 操作没有完成就按返回的 MYSQL_WAIT_xxx 注册事件返回，完成了进入下一个状态接着做，
+ * 直到连接空闲并且没有排队的任务。
+ */
+void CDBAsyncPool::_Run(Conn *c, int ready)
+{
+	for (;;)
+	{
+		int status = 0;
+		switch (c->state)
+		{
+		case CONN_CONNECT:
+			status = ready ? mysql_real_connect_cont(&c->ret_mysql, c->mysql, ready)
+						   : mysql_real_connect_start(&c->ret_mysql, c->mysql, m_db_server_ip.c_str(), m_username.c_str(),
+													  m_password.c_str(), m_db_name.c_str(), m_db_server_port, NULL, 0);
+			if (status)
+				break;
+			if (!c->ret_mysql)
+			{
+				printf("mysql_real_connect failed: %s\n", mysql_error(c->mysql));
+				if (c->task)
+				{
+					_Finish(c, NULL, mysql_errno(c->mysql));
+				}
+				_SetDead(c);
+				_Wait(c, 0);
+				if (!_Alive())
+				{
+					_FailAll();
+				}
+				return;
+			}
+			// 重连成功，重新执行断线时的任务
+			c->backoff_ms = 0;
+			c->state = c->task ? CONN_QUERY : CONN_IDLE;
+			break;
+		case CONN_IDLE:
+			if (m_tasks.empty())
+			{
+				_Wait(c, 0);
+				m_idle.push_back(c);
+				return;
+			}
+			c->task = m_tasks.front();
+			m_tasks.pop_front();
+			c->retried = false;
+			m_busy++;
+			c->state = CONN_QUERY;
+			break;
+		case CONN_QUERY:
+			status = ready ? mysql_real_query_cont(&c->ret, c->mysql, ready)
+						   : mysql_real_query_start(&c->ret, c->mysql, c->task->sql.c_str(), c->task->sql.size());
+			if (status)
+				break;
+			if (c->ret)
+			{
+				int err = mysql_errno(c->mysql);
+				if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+				{
+					// 语句没发出去(GONE)才重连后再执行一次；LOST 时可能已经执行了，只重连不重试
+					if (err != CR_SERVER_GONE_ERROR || c->retried)
+						_Finish(c, NULL, err);
+					c->retried = true;
+					_Open(c);
+					if (!c->mysql && c->task)
+						_Finish(c, NULL, err);
+					break;
+				}
+				_Finish(c, NULL, err);
+				c->state = CONN_IDLE;
+				break;
+			}
+			c->state = CONN_STORE;
+			break;
+		case CONN_STORE:
+			status = ready ? mysql_store_result_cont(&c->res, c->mysql, ready)
+						   : mysql_store_result_start(&c->res, c->mysql);
+			if (status)
+				break;
+			// 没有结果集的语句 res 为 NULL 并且 field_count 为 0
+			_Finish(c, c->res, (!c->res && mysql_field_count(c->mysql)) ? mysql_errno(c->mysql) : 0);
+			c->res = NULL;
+			c->state = CONN_IDLE;
+			break;
+		case CONN_DEAD:
+		default:
+			_Wait(c, 0);
+			if (!_Alive())
+			{
+				_FailAll();
+			}
+			return;
+		}
+
+		if (status)
+		{
+			_Wait(c, status);
+			return;
+		}
+		ready = 0;
+	}
+}
+
+// 按 MYSQL_WAIT_xxx 修改 epoll 里注册的事件，status 为 0 时不再监听
+void CDBAsyncPool::_Wait(Conn *c, int status)
+{
+	int mask = 0;
+	if (status & MYSQL_WAIT_READ)
+		mask |= EPOLLIN;
+	if (status & MYSQL_WAIT_WRITE)
+		mask |= EPOLLOUT;
+	c->wait = status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE);
+
+	if (mask == c->mask)
+	{
+		return;
+	}
+
+	if (mask == 0)
+	{
+		del_event(m_reactor->epfd, c->e.fd);
+	}
+	else if (c->mask == 0)
+	{
+		c->e.fd = mysql_get_socket(c->mysql);	// 重连后 fd 会变
+		add_event(m_reactor->epfd, c->e.fd, mask, &c->e);
+	}
+	else
+	{
+		enable_event(m_reactor->epfd, c->e.fd, &c->e, mask & EPOLLIN, mask & EPOLLOUT);
+	}
+	c->mask = mask;
+}
+
+void CDBAsyncPool::_Finish(Conn *c, MYSQL_RES *res, int err)
+{
+	Task *task = c->task;
+	c->task = NULL;
+	m_busy--;
+
+	CResultSet *result_set = res ? new CResultSet(res) : NULL;
+	if (task->cb)
+	{
+		task->cb(result_set, err, task->privdata);
+	}
+	delete result_set;
+	delete task;
+}
+
+bool CDBAsyncPool::_Alive()
+{
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		if (m_conns[i]->state != CONN_DEAD)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t CDBAsyncPool::_NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 连不上了，退避时间翻倍，到时间之前不再重连
+void CDBAsyncPool::_SetDead(Conn *c)
+{
+	c->state = CONN_DEAD;
+	c->backoff_ms = c->backoff_ms ? c->backoff_ms * 2 : DB_ASYNC_RETRY_MIN_MS;
+	if (c->backoff_ms > DB_ASYNC_RETRY_MAX_MS)
+	{
+		c->backoff_ms = DB_ASYNC_RETRY_MAX_MS;
+	}
+	c->retry_at = _NowMs() + c->backoff_ms;
+}
+
+// 有任务排队又没有空闲连接，退避时间到了的断开连接重新连
+void CDBAsyncPool::_Revive()
+{
+	uint64_t now = 0;
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		Conn *c = m_conns[i];
+		if (c->state != CONN_DEAD)
+		{
+			continue;
+		}
+		if (!now)
+		{
+			now = _NowMs();
+		}
+		if (now < c->retry_at)
+		{
+			continue;
+		}
+		_Open(c);
+		if (c->mysql)
+		{
+			_Run(c, 0);
+		}
+	}
+}
+
+// 没有能用的连接了，排队的任务都以失败回调。
+// 回调里重试的 Query 只排队，不再进来，否则一直连不上时会无限递归；
+// 这些任务等连接恢复或者下一次 Query 时再处理
+void CDBAsyncPool::_FailAll()
+{
+	if (m_failing)
+	{
+		return;
+	}
+	m_failing = true;
+
+	deque<Task*> tasks;
+	tasks.swap(m_tasks);
+	while (!tasks.empty())
+	{
+		Task *task = tasks.front();
+		tasks.pop_front();
+		if (task->cb)
+		{
+			task->cb(NULL, CR_SERVER_GONE_ERROR, task->privdata);
+		}
+		delete task;
+	}
+
+	m_failing = false;
+}
+
+#endif /* DBASYNC_H_ */
@@ -1,5 +1,6 @@
 #include "DBPool.h"
 #include <string.h>
+#include <errmsg.h>
 
 #define log_error printf
 #define log_warn printf
@@ -7,13 +8,36 @@
 #define MIN_DB_CONN_CNT 1
 #define MAX_DB_CONN_FAIL_NUM 10
 
+// 连接断了(服务端重启、wait_timeout 踢掉)，由 CDBConn::_Reconnect 重建连接，不用 MYSQL_OPT_RECONNECT
+#define IS_CONN_LOST(err)	((err) == CR_SERVER_GONE_ERROR || (err) == CR_SERVER_LOST)
 
-CResultSet::CResultSet(MYSQL_RES *res)
+static uint64_t get_tick_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t get_tick_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -DMEMLEAK_POOL_TRACE: 借出/归还连接时通知 memleak_detect/memleak.c，报告借了没还的连接和调用栈
+#include "memleak.h"
+
+
+CResultSet::CResultSet(MYSQL_RES *res, MYSQL *mysql)
 {
 	m_res = res;
+	m_mysql = mysql;
+	m_row = NULL;
+	m_lengths = NULL;
+	m_errno = 0;
 
 	// map table field key to index in the result array
 	int num_fields = mysql_num_fields(m_res);
+	m_num_fields = num_fields;
 	MYSQL_FIELD *fields = mysql_fetch_fields(m_res);
 	for (int i = 0; i < num_fields; i++)
 	{
@@ -36,10 +60,15 @@ bool CResultSet::Next()
 	m_row = mysql_fetch_row(m_res);
 	if (m_row)
 	{
+		m_lengths = mysql_fetch_lengths(m_res);
 		return true;
 	}
 	else
 	{
+		if (m_mysql && (m_errno = mysql_errno(m_mysql)))	// 流式读取时断线等错误也是返回 NULL
+		{
+			log_error("mysql_fetch_row failed: %s\n", mysql_error(m_mysql));
+		}
 		return false;
 	}
 }
@@ -83,16 +112,45 @@ char *CResultSet::GetString(const char *key)
 	}
 }
 
+bool CResultSet::IsNull(int idx)
+{
+	return idx < 0 || idx >= m_num_fields || !m_row[idx];
+}
+
+int64_t CResultSet::GetInt64(int idx)
+{
+	return IsNull(idx) ? 0 : strtoll(m_row[idx], NULL, 10);
+}
+
+double CResultSet::GetDouble(int idx)
+{
+	return IsNull(idx) ? 0 : strtod(m_row[idx], NULL);
+}
+
+CStrRef CResultSet::GetStrRef(int idx)
+{
+	CStrRef ref = {NULL, 0};
+	if (!IsNull(idx))
+	{
+		ref.data = m_row[idx];
+		ref.size = m_lengths[idx];	// 二进制数据里可能有 '\0'，不能用 strlen
+	}
+	return ref;
+}
+
 /////////////////////////////////////////
 CPrepareStatement::CPrepareStatement()
 {
 	m_stmt = NULL;
 	m_param_bind = NULL;
 	m_param_cnt = 0;
+	m_result_bind = NULL;
 }
 
 CPrepareStatement::~CPrepareStatement()
 {
+	_FreeResult();
+
 	if (m_stmt)
 	{
 		mysql_stmt_close(m_stmt);
@@ -108,8 +166,7 @@ CPrepareStatement::~CPrepareStatement()
 
 bool CPrepareStatement::Init(MYSQL *mysql, string &sql)
 {
-	mysql_ping(mysql);	// 当mysql连接丢失的时候，使用mysql_ping能够自动重连数据库
-
+	// 不再每次先 mysql_ping，连接断了由 CDBConn::GetPrepareStatement 重连再 prepare 一次
 	//g_master_conn_fail_num ++;
 	m_stmt = mysql_stmt_init(mysql);
 	if (!m_stmt)
@@ -121,6 +178,8 @@ bool CPrepareStatement::Init(MYSQL *mysql, string &sql)
 	if (mysql_stmt_prepare(m_stmt, sql.c_str(), sql.size()))
 	{
 		log_error("mysql_stmt_prepare failed: %s\n", mysql_stmt_error(m_stmt));
+		mysql_stmt_close(m_stmt);
+		m_stmt = NULL;
 		return false;
 	}
 
@@ -224,6 +283,204 @@ uint32_t CPrepareStatement::GetInsertId()
 	return mysql_stmt_insert_id(m_stmt);
 }
 
+void CPrepareStatement::_FreeResult()
+{
+	if (m_result_bind)
+	{
+		if (m_stmt)
+		{
+			mysql_stmt_free_result(m_stmt);
+		}
+		delete[] m_result_bind;
+		m_result_bind = NULL;
+	}
+	m_result_cols.clear();
+}
+
+bool CPrepareStatement::ExecuteQuery()
+{
+	if (!m_stmt)
+	{
+		log_error("no m_stmt\n");
+		return false;
+	}
+
+	_FreeResult();	// 缓存的语句再次执行，先释放上次的结果
+
+	if (m_param_cnt > 0 && mysql_stmt_bind_param(m_stmt, m_param_bind))
+	{
+		log_error("mysql_stmt_bind_param failed: %s\n", mysql_stmt_error(m_stmt));
+		return false;
+	}
+
+	if (mysql_stmt_execute(m_stmt))
+	{
+		log_error("mysql_stmt_execute failed: %s\n", mysql_stmt_error(m_stmt));
+		return false;
+	}
+
+	MYSQL_RES *meta = mysql_stmt_result_metadata(m_stmt);
+	if (!meta)
+	{
+		log_error("ExecuteQuery have no result: %s\n", mysql_stmt_error(m_stmt));
+		return false;
+	}
+
+	// 先把结果取到客户端，拿到每列的 max_length，字符串列按最长的分配缓冲区，不会截断
+	db_bool update_max_length = 1;
+	mysql_stmt_attr_set(m_stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+	if (mysql_stmt_store_result(m_stmt))
+	{
+		log_error("mysql_stmt_store_result failed: %s\n", mysql_stmt_error(m_stmt));
+		mysql_free_result(meta);
+		return false;
+	}
+
+	int num_fields = mysql_num_fields(meta);
+	MYSQL_FIELD *fields = mysql_fetch_fields(meta);
+	m_result_cols.resize(num_fields);	// 下面绑定的是元素的地址，之后不能再改大小
+	m_result_bind = new MYSQL_BIND[num_fields];
+	memset(m_result_bind, 0, sizeof(MYSQL_BIND) * num_fields);
+
+	for (int i = 0; i < num_fields; i++)
+	{
+		ResultColumn &col = m_result_cols[i];
+		MYSQL_BIND &bind = m_result_bind[i];
+		col.name = fields[i].name;
+
+		switch (fields[i].type)
+		{
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+			col.type = MYSQL_TYPE_LONGLONG;	// 整数都按 64 位取
+			bind.buffer = &col.int_value;
+			bind.is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+			break;
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+			col.type = MYSQL_TYPE_DOUBLE;
+			bind.buffer = &col.double_value;
+			break;
+		default:
+			col.type = MYSQL_TYPE_STRING;
+			col.buf.resize(fields[i].max_length + 1);
+			bind.buffer = &col.buf[0];
+			bind.buffer_length = col.buf.size();
+			break;
+		}
+
+		bind.buffer_type = col.type;
+		bind.length = &col.length;
+		bind.is_null = &col.is_null;
+		bind.error = &col.error;
+	}
+	mysql_free_result(meta);
+
+	if (mysql_stmt_bind_result(m_stmt, m_result_bind))
+	{
+		log_error("mysql_stmt_bind_result failed: %s\n", mysql_stmt_error(m_stmt));
+		_FreeResult();
+		return false;
+	}
+
+	return true;
+}
+
+bool CPrepareStatement::Fetch()
+{
+	if (!m_result_bind)
+	{
+		return false;
+	}
+
+	int ret = mysql_stmt_fetch(m_stmt);
+	if (ret == 1)
+	{
+		log_error("mysql_stmt_fetch failed: %s\n", mysql_stmt_error(m_stmt));
+	}
+
+	// 缓冲区按 max_length 分配，MYSQL_DATA_TRUNCATED 不会出现，出现了也照样返回这一行
+	return ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+}
+
+int CPrepareStatement::GetIndex(const char *key)
+{
+	for (size_t i = 0; i < m_result_cols.size(); i++)
+	{
+		if (m_result_cols[i].name == key)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool CPrepareStatement::IsNull(int idx)
+{
+	return idx < 0 || idx >= (int)m_result_cols.size() || m_result_cols[idx].is_null;
+}
+
+int64_t CPrepareStatement::GetInt64(int idx)
+{
+	if (IsNull(idx))
+	{
+		return 0;
+	}
+
+	ResultColumn &col = m_result_cols[idx];
+	if (col.type == MYSQL_TYPE_LONGLONG)
+	{
+		return col.int_value;
+	}
+	else if (col.type == MYSQL_TYPE_DOUBLE)
+	{
+		return (int64_t)col.double_value;
+	}
+	else
+	{
+		col.buf[col.length] = '\0';	// 多分配了一个字节
+		return strtoll(&col.buf[0], NULL, 10);
+	}
+}
+
+double CPrepareStatement::GetDouble(int idx)
+{
+	if (IsNull(idx))
+	{
+		return 0;
+	}
+
+	ResultColumn &col = m_result_cols[idx];
+	if (col.type == MYSQL_TYPE_LONGLONG)
+	{
+		return col.int_value;
+	}
+	else if (col.type == MYSQL_TYPE_DOUBLE)
+	{
+		return col.double_value;
+	}
+	else
+	{
+		col.buf[col.length] = '\0';
+		return strtod(&col.buf[0], NULL);
+	}
+}
+
+CStrRef CPrepareStatement::GetStrRef(int idx)
+{
+	CStrRef ref = {NULL, 0};
+	if (!IsNull(idx) && m_result_cols[idx].type == MYSQL_TYPE_STRING)
+	{
+		ref.data = &m_result_cols[idx].buf[0];
+		ref.size = m_result_cols[idx].length;
+	}
+	return ref;
+}
+
 /////////////////////
 CDBConn::CDBConn(CDBPool *pPool)
 {
@@ -233,6 +490,7 @@ CDBConn::CDBConn(CDBPool *pPool)
 
 CDBConn::~CDBConn()
 {
+	_ClearStmtCache();	// 要在 mysql_close 之前
 	if (m_mysql)
 	{
 		mysql_close(m_mysql);
@@ -248,8 +506,10 @@ int CDBConn::Init()
 		return 1;
 	}
 
-	int reconnect = 1;
-	mysql_options(m_mysql, MYSQL_OPT_RECONNECT, &reconnect);	// 配合mysql_ping实现自动重连
+	// 不能让客户端库自动重连: 它会在新连接上重发断线时的语句，事务中的语句就脱离了事务单独提交。
+	// 断线由 _Query/_Ping 发现后调 _Reconnect，事务中不重试
+	bool reconnect = false;	// MySQL 8.0 的头文件没有 my_bool 了
+	mysql_options(m_mysql, MYSQL_OPT_RECONNECT, &reconnect);
 	mysql_options(m_mysql, MYSQL_SET_CHARSET_NAME, "utf8mb4");	// utf8mb4和utf8区别
 
 	// ip 端口 用户名 密码 数据库名
@@ -263,16 +523,162 @@ int CDBConn::Init()
 	return 0;
 }
 
+// 关闭旧连接重新建一个，服务端的预处理语句和事务都随旧连接没了
+bool CDBConn::_Reconnect()
+{
+	_ClearStmtCache();	// 要在 mysql_close 之前
+	m_stmt_thread_id = 0;
+	m_in_trans = false;
+	mysql_close(m_mysql);
+	m_mysql = NULL;
+	return Init() == 0;
+}
+
+// 空闲太久的连接借出时检查一下，断了就重连
+bool CDBConn::_Ping()
+{
+	if (!mysql_ping(m_mysql))
+	{
+		return true;
+	}
+
+	log_warn("mysql ping failed: %s, reconnect\n", mysql_error(m_mysql));
+	return _Reconnect();
+}
+
 const char *CDBConn::GetPoolName()
 {
 	return m_pDBPool->GetPoolName();
 }
 
+CPrepareStatement *CDBConn::GetPrepareStatement(const string &sql)
+{
+	// 上次用缓存的语句时连接断了，先重连，下面按 thread id 清掉旧的语句
+	if (!m_stmt_lru.empty() && IS_CONN_LOST(mysql_stmt_errno(m_stmt_lru.front().second->m_stmt)))
+	{
+		_Reconnect();
+	}
+
+	if (m_stmt_thread_id != mysql_thread_id(m_mysql))
+	{
+		_ClearStmtCache();
+		m_stmt_thread_id = mysql_thread_id(m_mysql);
+	}
+
+	map<string, StmtList::iterator>::iterator it = m_stmt_map.find(sql);
+	if (it != m_stmt_map.end())
+	{
+		m_stmt_lru.splice(m_stmt_lru.begin(), m_stmt_lru, it->second);	// 移到表头
+		return it->second->second;
+	}
+
+	CPrepareStatement *stmt = new CPrepareStatement();
+	string str_sql = sql;
+	bool ok = stmt->Init(m_mysql, str_sql);
+	if (!ok && IS_CONN_LOST(mysql_errno(m_mysql)))
+	{
+		// prepare 不会改数据，重连后再来一次；但事务已经没了，事务中只重连不重试
+		bool retry = !m_in_trans;
+		if (_Reconnect() && retry)
+		{
+			delete stmt;
+			stmt = new CPrepareStatement();
+			ok = stmt->Init(m_mysql, str_sql);
+		}
+	}
+	if (!ok)
+	{
+		delete stmt;
+		return NULL;
+	}
+
+	if (m_stmt_thread_id != mysql_thread_id(m_mysql))	// 重连过
+	{
+		_ClearStmtCache();
+		m_stmt_thread_id = mysql_thread_id(m_mysql);
+	}
+
+	if (m_stmt_lru.size() >= DB_STMT_CACHE_SIZE)	// 淘汰最久没用的
+	{
+		m_stmt_map.erase(m_stmt_lru.back().first);
+		delete m_stmt_lru.back().second;	// mysql_stmt_close 同时释放服务端的语句
+		m_stmt_lru.pop_back();
+	}
+
+	m_stmt_lru.push_front(make_pair(sql, stmt));
+	m_stmt_map[sql] = m_stmt_lru.begin();
+	return stmt;
+}
+
+void CDBConn::_ClearStmtCache()
+{
+	for (StmtList::iterator it = m_stmt_lru.begin(); it != m_stmt_lru.end(); it++)
+	{
+		delete it->second;
+	}
+	m_stmt_lru.clear();
+	m_stmt_map.clear();
+}
+
+// 服务端一个包最大多少字节，批量插入拼的 SQL 不能超过它
+uint32_t CDBConn::_GetMaxPacket()
+{
+	if (m_max_packet)
+	{
+		return m_max_packet;
+	}
+
+	m_max_packet = 1024 * 1024;	// 查不到按 1M，比 5.7/8.0 的默认值都小
+	CResultSet *result_set = ExecuteQuery("select @@max_allowed_packet as max_packet");
+	if (result_set)
+	{
+		if (result_set->Next() && result_set->GetInt("max_packet") > 0)
+		{
+			m_max_packet = result_set->GetInt("max_packet");
+		}
+		delete result_set;
+	}
+
+	return m_max_packet;
+}
+
+/*
+ * 执行 SQL，连接断了就 _Reconnect 重连，省掉以前每条语句之前的 mysql_ping 往返。
+ * 只有 CR_SERVER_GONE_ERROR(语句还没发出去)才重连后再执行一次；CR_SERVER_LOST 时语句
+ * 可能已经在服务端执行完，重试会让非幂等的更新执行两次，只重连不重试，由调用方决定。
+ * 事务中也不重试: 重连后事务已经回滚，后面的语句单独提交会破坏原子性，只重连让下一个事务能用。
+ */
+bool CDBConn::_Query(const char *sql_query, unsigned long len)
+{
+	uint64_t start = get_tick_us();
+	int ret = mysql_real_query(m_mysql, sql_query, len);
+	m_query_us += get_tick_us() - start;	// 只算第一次执行的往返，不算断线重连
+	m_query_cnt++;
+	if (!ret)
+	{
+		return true;
+	}
+
+	unsigned int err = mysql_errno(m_mysql);
+	if (!IS_CONN_LOST(err))
+	{
+		return false;
+	}
+
+	log_warn("mysql connection lost: %s, reconnect\n", mysql_error(m_mysql));
+	bool retry = !m_in_trans && err == CR_SERVER_GONE_ERROR;
+	if (!_Reconnect() || !retry)
+	{
+		return false;
+	}
+
+	return !mysql_real_query(m_mysql, sql_query, len);
+}
+
 bool CDBConn::ExecuteCreate(const char *sql_query)
 {
-	mysql_ping(m_mysql);
 	// mysql_real_query 实际就是执行了SQL
-	if (mysql_real_query(m_mysql, sql_query, strlen(sql_query)))
+	if (!_Query(sql_query, strlen(sql_query)))
 	{
 		log_error("mysql_real_query failed: %s, sql: start transaction\n", mysql_error(m_mysql));
 		return false;
@@ -282,9 +688,7 @@ bool CDBConn::ExecuteCreate(const char *sql_query)
 }
 bool CDBConn::ExecuteDrop(const char *sql_query)
 {
-	mysql_ping(m_mysql);	// 如果端开了，能够自动重连
-
-	if (mysql_real_query(m_mysql, sql_query, strlen(sql_query)))
+	if (!_Query(sql_query, strlen(sql_query)))	// 如果端开了，能够自动重连
 	{
 		log_error("mysql_real_query failed: %s, sql: start transaction\n", mysql_error(m_mysql));
 		return false;
@@ -293,24 +697,22 @@ bool CDBConn::ExecuteDrop(const char *sql_query)
 	return true;
 }
 
-CResultSet *CDBConn::ExecuteQuery(const char *sql_query)
+CResultSet *CDBConn::ExecuteQuery(const char *sql_query, bool use_result)
 {
-	mysql_ping(m_mysql);
-
-	if (mysql_real_query(m_mysql, sql_query, strlen(sql_query)))
+	if (!_Query(sql_query, strlen(sql_query)))
 	{
 		log_error("mysql_real_query failed: %s, sql: %s\n", mysql_error(m_mysql), sql_query);
 		return NULL;
 	}
-	// 返回结果
-	MYSQL_RES *res = mysql_store_result(m_mysql);	// 返回结果
+	// 返回结果，use_result 时只读了结果的头，行在 Next 里一行一行从网络读
+	MYSQL_RES *res = use_result ? mysql_use_result(m_mysql) : mysql_store_result(m_mysql);	// 返回结果
 	if (!res)
 	{
-		log_error("mysql_store_result failed: %s\n", mysql_error(m_mysql));
+		log_error("%s failed: %s\n", use_result ? "mysql_use_result" : "mysql_store_result", mysql_error(m_mysql));
 		return NULL;
 	}
 
-	CResultSet *result_set = new CResultSet(res);	// 存储到CResultSet
+	CResultSet *result_set = new CResultSet(res, m_mysql);	// 存储到CResultSet
 	return result_set;
 }
 
@@ -326,9 +728,7 @@ mysql_affected_rows返回的是实际更新的行数,而不是匹配到的行数
 */
 bool CDBConn::ExecuteUpdate(const char *sql_query, bool care_affected_rows)
 {
-	mysql_ping(m_mysql);
-
-	if (mysql_real_query(m_mysql, sql_query, strlen(sql_query)))
+	if (!_Query(sql_query, strlen(sql_query)))
 	{
 		log_error("mysql_real_query failed: %s, sql: %s\n", mysql_error(m_mysql), sql_query);
 		//g_master_conn_fail_num ++;
@@ -388,22 +788,22 @@ bool CDBConn::ExecuteUpdate(const char *sql_query, bool care_affected_rows)
 
 bool CDBConn::StartTransaction()
 {
-	mysql_ping(m_mysql);
-
-	if (mysql_real_query(m_mysql, "start transaction\n", 17))
+	if (!_Query("start transaction\n", 17))
 	{
 		log_error("mysql_real_query failed: %s, sql: start transaction\n", mysql_error(m_mysql));
 		return false;
 	}
 
+	m_in_trans = true;
+
 	return true;
 }
 
 bool CDBConn::Rollback()
 {
-	mysql_ping(m_mysql);
+	m_in_trans = false;	// 失败了事务也已经不在了
 
-	if (mysql_real_query(m_mysql, "rollback\n", 8))
+	if (!_Query("rollback\n", 8))
 	{
 		log_error("mysql_real_query failed: %s, sql: rollback\n", mysql_error(m_mysql));
 		return false;
@@ -414,9 +814,11 @@ bool CDBConn::Rollback()
 
 bool CDBConn::Commit()
 {
-	mysql_ping(m_mysql);
+	// 执行完再清 m_in_trans，断线时 _Query 不会重试 commit，事务已经在服务端回滚
+	bool ok = _Query("commit\n", 6);
+	m_in_trans = false;
 
-	if (mysql_real_query(m_mysql, "commit\n", 6))
+	if (!ok)
 	{
 		log_error("mysql_real_query failed: %s, sql: commit\n", mysql_error(m_mysql));
 		return false;
@@ -429,6 +831,159 @@ uint32_t CDBConn::GetInsertId()
 	return (uint32_t)mysql_insert_id(m_mysql);
 }
 
+/////////////////////
+CBatchInsert::CBatchInsert(CDBConn *pDBConn, const string &insert_head, uint32_t max_rows)
+{
+	m_pDBConn = pDBConn;
+	m_head = insert_head + " values ";
+	m_max_rows = max_rows ? max_rows : 1;
+	m_max_bytes = pDBConn->_GetMaxPacket() - 1024;	// 留点余量给包头
+}
+
+CBatchInsert::~CBatchInsert()
+{
+	Flush();
+}
+
+void CBatchInsert::BeginRow()
+{
+	m_row = "(";
+	m_row_bad = false;
+}
+
+void CBatchInsert::_NextValue()
+{
+	if (m_row.size() > 1)
+	{
+		m_row += ',';
+	}
+}
+
+void CBatchInsert::AddValue(const string &value)
+{
+	_NextValue();
+	// 转义后最长是 2 倍 + 1
+	size_t pos = m_row.size();
+	m_row.resize(pos + 1 + value.size() * 2 + 1);
+	m_row[pos] = '\'';
+	unsigned long len = mysql_real_escape_string(m_pDBConn->GetMysql(), &m_row[pos + 1], value.c_str(), value.size());
+	if (len == (unsigned long)-1)
+	{
+		// 服务端开了 NO_BACKSLASH_ESCAPES 时新版客户端库拒绝转义，整行作废，由 EndRow 报告
+		log_error("mysql_real_escape_string failed: %s\n", mysql_error(m_pDBConn->GetMysql()));
+		m_row_bad = true;
+		len = 0;
+	}
+	m_row.resize(pos + 1 + len);
+	m_row += '\'';
+}
+
+void CBatchInsert::AddValue(int value)
+{
+	AddValue((int64_t)value);
+}
+
+void CBatchInsert::AddValue(uint32_t value)
+{
+	AddValue((uint64_t)value);
+}
+
+void CBatchInsert::AddValue(int64_t value)
+{
+	_NextValue();
+	m_row += to_string(value);
+}
+
+void CBatchInsert::AddValue(uint64_t value)
+{
+	_NextValue();
+	m_row += to_string(value);
+}
+
+void CBatchInsert::AddNull()
+{
+	_NextValue();
+	m_row += "NULL";
+}
+
+bool CBatchInsert::EndRow()
+{
+	bool ret = true;
+
+	if (m_row_bad)
+	{
+		DBBatchResult result = { false, 1, 0, 0 };
+		m_results.push_back(result);
+		m_row.clear();
+		m_row_bad = false;
+		return false;
+	}
+
+	m_row += ')';
+	// 加上这一行会超过包大小，先把前面的提交；单独一行就超过的只能交给服务端报错
+	if (m_rows > 0 && m_sql.size() + 1 + m_row.size() > m_max_bytes)
+	{
+		ret = Flush();
+	}
+
+	if (m_rows == 0)
+	{
+		m_sql = m_head;
+	}
+	else
+	{
+		m_sql += ',';
+	}
+	m_sql += m_row;
+	m_rows++;
+
+	if (m_rows >= m_max_rows)
+	{
+		ret = Flush() && ret;
+	}
+
+	return ret;
+}
+
+bool CBatchInsert::Flush()
+{
+	if (m_rows == 0)
+	{
+		return true;
+	}
+
+	MYSQL *mysql = m_pDBConn->GetMysql();
+	DBBatchResult result;
+	result.rows = m_rows;
+	result.ok = m_pDBConn->_Query(m_sql.c_str(), m_sql.size());
+	result.affected_rows = result.ok ? mysql_affected_rows(mysql) : 0;
+	result.first_insert_id = result.ok ? mysql_insert_id(mysql) : 0;	// 多行 insert 返回的是第一行的 id
+	if (!result.ok)
+	{
+		log_error("batch insert %u rows failed: %s, sql: %.128s\n", m_rows, mysql_error(mysql), m_sql.c_str());
+	}
+
+	m_results.push_back(result);
+	m_sql.clear();
+	m_rows = 0;
+
+	return result.ok;
+}
+
+uint32_t CBatchInsert::GetFailedRows()
+{
+	uint32_t rows = 0;
+	for (size_t i = 0; i < m_results.size(); i++)
+	{
+		if (!m_results[i].ok)
+		{
+			rows += m_results[i].rows;
+		}
+	}
+
+	return rows;
+}
+
 ////////////////
 CDBPool::CDBPool(const char *pool_name, const char *db_server_ip, uint16_t db_server_port,
 				 const char *username, const char *password, const char *db_name, int max_conn_cnt)
@@ -440,152 +995,384 @@ CDBPool::CDBPool(const char *pool_name, const char *db_server_ip, uint16_t db_se
 	m_password = password;
 	m_db_name = db_name;
 	m_db_max_conn_cnt = max_conn_cnt;	// 
-	m_db_cur_conn_cnt = MIN_DB_CONN_CNT; // 最小连接数量
+	m_db_cur_conn_cnt = 0;
+	m_conn_slot = 0;
+	m_conns.assign(max_conn_cnt, NULL);	// 下标固定，空闲栈里存的是下标
+	m_min_idle = MIN_DB_CONN_CNT < max_conn_cnt ? MIN_DB_CONN_CNT : max_conn_cnt;
+	m_trace_id = MEMLEAK_POOL_REGISTER(pool_name);
 }
 
 // 释放连接池
 CDBPool::~CDBPool()
 {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_abort_request = true;
+		m_cond_var.notify_all();		// 通知所有在等待的
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_fill_mutex);
+		m_fill_cond.notify_all();
+	}
+	if (m_filler.joinable())
+	{
+		m_filler.join();	// 等正在建立的连接完成，它们也会放进空闲栈
+	}
+
 	std::lock_guard<std::mutex> lock(m_mutex);
-	m_abort_request = true;
-	m_cond_var.notify_all();		// 通知所有在等待的
+	MEMLEAK_POOL(unregister, m_trace_id);
 
-	for (list<CDBConn *>::iterator it = m_free_list.begin(); it != m_free_list.end(); it++)
+	// 和原来一样只释放空闲的连接，借出去的由使用者负责
+	for (size_t i = 0; i < m_conns.size(); i++)
 	{
-		CDBConn *pConn = *it;
-		delete pConn;
+		CDBConn *pConn = m_conns[i];
+		if (pConn && pConn->m_state == CDBConn::CONN_FREE)
+		{
+			delete pConn;
+		}
 	}
 
-	m_free_list.clear();
+	m_conns.clear();
+	m_free_top = 0;
+}
+
+void CDBPool::SetMinIdle(int min_idle)
+{
+	if (min_idle < 0)
+	{
+		min_idle = 0;
+	}
+	m_min_idle = min_idle < m_db_max_conn_cnt ? min_idle : m_db_max_conn_cnt;
 }
 
 int CDBPool::Init()
 {
-	// 创建固定最小的连接数量
-	for (int i = 0; i < m_db_cur_conn_cnt; i++)
+	// 创建固定最小的连接数量，并行握手，启动时间是一次握手而不是 m_min_idle 次
+	int created = _CreateConns(m_min_idle);
+	if (created < m_min_idle)
 	{
-		CDBConn *pDBConn = new CDBConn(this);
-		int ret = pDBConn->Init();
-		if (ret)
+		log_error("db pool: %s, init %d/%d connections\n", m_pool_name.c_str(), created, m_min_idle);
+		return 1;
+	}
+
+	m_filler = std::thread(&CDBPool::_FillLoop, this);
+
+	// log_info("db pool: %s, size: %d\n", m_pool_name.c_str(), (int)m_db_cur_conn_cnt);
+	return 0;
+}
+
+// 并行建立 n 个连接放进空闲栈，返回成功的个数。n-1 个临时线程加上当前线程，每个线程一次握手
+int CDBPool::_CreateConns(int n)
+{
+	std::atomic<int> created{0};
+	auto create = [this, &created] {
+		CDBConn *pDBConn = _CreateConn();
+		if (pDBConn)
 		{
-			delete pDBConn;
-			return ret;
+			created++;
+			_PutFree(pDBConn);
 		}
+	};
 
-		m_free_list.push_back(pDBConn);
+	vector<std::thread> threads;
+	for (int i = 1; i < n; i++)
+	{
+		threads.emplace_back(create);
+	}
+	if (n > 0)
+	{
+		create();
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
 	}
 
-	// log_info("db pool: %s, size: %d\n", m_pool_name.c_str(), (int)m_free_list.size());
-	return 0;
+	return created;
+}
+
+void CDBPool::_KickFiller()
+{
+	if (!m_fill_kick.exchange(true))
+	{
+		std::lock_guard<std::mutex> lock(m_fill_mutex);
+		m_fill_cond.notify_one();
+	}
+}
+
+/*
+ * 后台建连线程: 空闲连接少于 m_min_idle + m_burst，或者有调用方取不到连接时，补充连接。
+ * 一轮里取不到连接的次数(m_misses)就是这一轮至少要建的数量，
+ * 出现缺口时 m_burst 翻倍，下一波流量到来之前就多备一些；连续 1 秒没有被叫醒则减半。
+ */
+void CDBPool::_FillLoop()
+{
+	while (!m_abort_request)
+	{
+		bool kicked;
+		{
+			std::unique_lock<std::mutex> lock(m_fill_mutex);
+			kicked = m_fill_cond.wait_for(lock, std::chrono::seconds(1), [this] {
+				return m_fill_kick.load() || m_abort_request.load();
+			});
+		}
+		if (m_abort_request)
+		{
+			break;
+		}
+		m_fill_kick = false;
+
+		int misses = m_misses.exchange(0);
+		if (misses > 0)
+		{
+			m_burst = m_burst ? m_burst * 2 : 1;
+			if (m_burst > m_db_max_conn_cnt)
+			{
+				m_burst = m_db_max_conn_cnt;
+			}
+		}
+		else if (!kicked)
+		{
+			m_burst /= 2;
+		}
+
+		int need = m_min_idle + m_burst - m_idle_cnt;
+		if (need < misses)
+		{
+			need = misses;
+		}
+		int room = m_db_max_conn_cnt - m_db_cur_conn_cnt;
+		if (need > room)
+		{
+			need = room;
+		}
+		if (need <= 0)
+		{
+			continue;
+		}
+
+		int created = _CreateConns(need);
+		if (created < need)
+		{
+			// 数据库连不上，让等待的调用方返回 NULL，而不是一直等下去
+			m_fill_fail++;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_cond_var.notify_all();
+		}
+	}
+}
+
+/*
+ * 空闲连接栈(Treiber 栈): m_free_top 低 32 位是栈顶连接的下标+1(0 表示空)，高 32 位是版本号，
+ * 每次出栈入栈都加 1，避免 ABA: A 出栈时读到的 next 已经过期，但栈顶又变回了 A。
+ * 连接只增不删，下标和 m_conns 中的指针创建后不再变化，出栈时读别人的 m_next 是安全的。
+ */
+void CDBPool::_PushFree(CDBConn *pConn)
+{
+	uint64_t top = m_free_top.load(std::memory_order_relaxed);
+	uint64_t next;
+
+	do
+	{
+		pConn->m_next.store((uint32_t)top, std::memory_order_relaxed);
+		next = ((top >> 32) + 1) << 32 | (pConn->m_index + 1);
+	} while (!m_free_top.compare_exchange_weak(top, next, std::memory_order_release, std::memory_order_relaxed));
+
+	m_idle_cnt++;
+}
+
+CDBConn *CDBPool::_PopFree()
+{
+	uint64_t top = m_free_top.load(std::memory_order_acquire);
+	uint64_t next;
+	CDBConn *pConn;
+
+	do
+	{
+		uint32_t idx = (uint32_t)top;
+		if (idx == 0)
+		{
+			return NULL;
+		}
+
+		pConn = m_conns[idx - 1];
+		next = ((top >> 32) + 1) << 32 | pConn->m_next.load(std::memory_order_relaxed);
+	} while (!m_free_top.compare_exchange_weak(top, next, std::memory_order_acquire, std::memory_order_acquire));
+
+	m_idle_cnt--;
+	return pConn;
+}
+
+// 放回空闲栈并唤醒一个等待者
+void CDBPool::_PutFree(CDBConn *pConn)
+{
+	_PushFree(pConn);
+
+	// 入栈要先于读 m_waiters，等待方是先 m_waiters++ 再检查空闲栈
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_waiters > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cond_var.notify_one();		// 通知取队列
+	}
+}
+
+// 还没到最大连接数时新建一个连接，不持有任何锁；到上限或者连接失败返回 NULL
+CDBConn *CDBPool::_CreateConn()
+{
+	// 先占一个名额，多个线程同时新建时不会超过 m_db_max_conn_cnt
+	int cnt = m_db_cur_conn_cnt.load();
+	do
+	{
+		if (cnt >= m_db_max_conn_cnt)
+		{
+			return NULL;
+		}
+	} while (!m_db_cur_conn_cnt.compare_exchange_weak(cnt, cnt + 1));
+
+	CDBConn *pDBConn = new CDBConn(this);	//新建连接
+	int ret = pDBConn->Init();
+	if (ret)
+	{
+		log_error("Init DBConnecton failed\n\n");
+		delete pDBConn;
+		m_db_cur_conn_cnt--;
+		return NULL;
+	}
+
+	// 成功的连接才分配下标，所以下标不会超过 m_db_max_conn_cnt - 1
+	pDBConn->m_index = m_conn_slot++;
+	pDBConn->m_last_used = get_tick_ms();
+	m_conns[pDBConn->m_index] = pDBConn;
+	// log_info("new db connection: %s, conn_cnt: %d\n", m_pool_name.c_str(), (int)m_db_cur_conn_cnt);
+
+	return pDBConn;
 }
 
 /*
  *TODO: 增加保护机制，把分配的连接加入另一个队列，这样获取连接时，如果没有空闲连接，
  *TODO: 检查已经分配的连接多久没有返回，如果超过一定时间，则自动收回连接，放在用户忘了调用释放连接的接口
+ * 定位谁借了没还: 用 -DMEMLEAK_POOL_TRACE 编译并链接 memleak.c，memleak_pool_dump 按调用栈输出没有归还的连接
  * timeout_ms默认为 0死等
  * timeout_ms >0 则为等待的时间
+ * 有空闲连接时只是一次 CAS 出栈，不加锁；没有空闲连接时叫醒后台线程建连，自己加锁等待，
+ * 等到的可能是新建的连接，也可能是别人归还的，不管哪个先到
  */
 
 CDBConn *CDBPool::GetDBConn(const int timeout_ms)
 {
-	std::unique_lock<std::mutex> lock(m_mutex);
 	if(m_abort_request) 
 	{
 		log_warn("have aboort\n");
 		return NULL;
 	}
 
-	if (m_free_list.empty())		// 2 当没有连接可以用时
+	CDBConn *pConn = _PopFree();	// 获取连接
+	if (pConn && m_idle_cnt < m_min_idle)
+	{
+		_KickFiller();	// 空闲连接不够了，提前补充
+	}
+
+	if (!pConn && !m_filler.joinable())	// 没有调用 Init，只能自己建连
 	{
-		// 第一步先检测 当前连接数量是否达到最大的连接数量 
-		if (m_db_cur_conn_cnt >= m_db_max_conn_cnt) // 等待的逻辑
+		pConn = _CreateConn();
+		if (!pConn && m_db_cur_conn_cnt < m_db_max_conn_cnt)
 		{
-			// 如果已经到达了，看看是否需要超时等待
-			if(timeout_ms <= 0)		// 死等，直到有连接可以用 或者 连接池要退出
-			{
-				log_info("wait ms:%d\n", timeout_ms);
-				m_cond_var.wait(lock, [this] 
-				{
-					log_info("wait:%d, size:%lu\n", wait_cout++, m_free_list.size());
-					// 当前连接数量小于最大连接数量 或者请求释放连接池时退出
-					return (!m_free_list.empty()) | m_abort_request;
-				});
-			} else {
-				// return如果返回 false，继续wait(或者超时),  如果返回true退出wait
-				// 1.m_free_list不为空
-				// 2.超时退出
-				// 3. m_abort_request被置为true，要释放整个连接池
-				m_cond_var.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
-					log_info("wait_for:%d, size:%lu\n", wait_cout++, m_free_list.size());
-					return (!m_free_list.empty()) | m_abort_request;
-				});
-				// 带超时功能时还要判断是否为空
-				if(m_free_list.empty()) 	// 如果连接池还是没有空闲则退出
-				{
-					return NULL;
-				}
-			}
+			m_fill_fail++;	// 不是满了，是连不上
+		}
+	}
+	else if (!pConn)		// 2 当没有连接可以用时
+	{
+		uint32_t fail = m_fill_fail;	// 在叫醒后台线程之前取，之后的建连失败都能看到
+
+		// 第一步先检测 当前连接数量是否达到最大的连接数量，没有到则让后台线程创建连接
+		if (m_db_cur_conn_cnt < m_db_max_conn_cnt)
+		{
+			m_misses++;
+			_KickFiller();
+		}
 
-			if(m_abort_request) 
+		// 先登记等待者再检查空闲栈，和 _PutFree 的 入栈 -> 看等待者 配合，不会漏掉唤醒
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_waiters++;
+
+		// return如果返回 false，继续wait(或者超时),  如果返回true退出wait
+		// 1.拿到了空闲连接
+		// 2.超时退出
+		// 3. m_abort_request被置为true，要释放整个连接池
+		auto ready = [this, &pConn, fail] {
+			pConn = _PopFree();
+			if (!pConn)
 			{
-				log_warn("have aboort\n");
-				return NULL;
+				log_info("wait:%d, cur_conn_cnt:%d\n", wait_cout++, (int)m_db_cur_conn_cnt);
 			}
+			return pConn != NULL || m_abort_request || fail != m_fill_fail;
+		};
+
+		// 如果已经到达了，看看是否需要超时等待
+		if(timeout_ms <= 0)		// 死等，直到有连接可以用 或者 连接池要退出
+		{
+			m_cond_var.wait(lock, ready);
 		}
-		else // 还没有到最大连接则创建连接
+		else
 		{
-			CDBConn *pDBConn = new CDBConn(this);	//新建连接
-			int ret = pDBConn->Init();
-			if (ret)
-			{
-				log_error("Init DBConnecton failed\n\n");
-				delete pDBConn;
-				return NULL;
-			}
-			else
+			m_cond_var.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+		}
+
+		m_waiters--;
+
+		if(m_abort_request) 
+		{
+			log_warn("have aboort\n");
+			if (pConn)
 			{
-				m_free_list.push_back(pDBConn);
-				m_db_cur_conn_cnt++;
-				// log_info("new db connection: %s, conn_cnt: %d\n", m_pool_name.c_str(), m_db_cur_conn_cnt);
+				_PushFree(pConn);
 			}
+			return NULL;
 		}
 	}
 
-	CDBConn *pConn = m_free_list.front();	// 获取连接
-	m_free_list.pop_front();	// STL 吐出连接，从空闲队列删除
-	//   pConn->setCurrentTime();  // 伪代码
+	// 带超时功能时还要判断是否为空，新建连接失败也是空
+	if (!pConn)
+	{
+		return NULL;
+	}
+
+	pConn->m_state = CDBConn::CONN_USED;
+	uint64_t now = get_tick_ms();
+	if (m_ping_idle_ms >= 0 && now - pConn->m_last_used >= (uint64_t)m_ping_idle_ms)
+	{
+		pConn->_Ping();	// 空闲太久，可能已经被服务端 wait_timeout 断开，先重连
+	}
+	pConn->m_query_cnt = 0;	// CDBRouter 归还时用来算这次借出的语句延迟
+	pConn->m_query_us = 0;
 	// m_used_list.push_back(pConn);		// 
+	MEMLEAK_POOL(get, m_trace_id, pConn, sizeof(CDBConn));
 
 	return pConn;
 }
 
-void CDBPool::RelDBConn(CDBConn *pConn)
+bool CDBPool::RelDBConn(CDBConn *pConn)
 {
 	if(!pConn) {
 		log_error("pConn is null");
-		return;
+		return false;
 	}
 
-	std::lock_guard<std::mutex> lock(m_mutex);
-	list<CDBConn *>::iterator it = m_free_list.begin();
-	for (; it != m_free_list.end(); it++)	// 避免重复归还
-	{
-		if (*it == pConn)	
-		{
-			break;  // 说明这个连接已经归还过
-		}
-	}
+	MEMLEAK_POOL(put, m_trace_id, pConn);	// 重复归还会记为 bad put
 
-	if (it == m_free_list.end())
-	{
-		// m_used_list.remove(pConn);
-		m_free_list.push_back(pConn);
-		m_cond_var.notify_one();		// 通知取队列
-	} 
-	else 
+	// 避免重复归还: 只有借出状态的连接才能归还，O(1)
+	int state = CDBConn::CONN_USED;
+	if (!pConn->m_state.compare_exchange_strong(state, CDBConn::CONN_FREE))
 	{
 		log_error("RelDBConn failed\n"); // 不再次回收连接
+		return false;
 	}
+
+	// m_used_list.remove(pConn);
+	pConn->m_last_used = get_tick_ms();
+	_PutFree(pConn);
+	return true;
 }
 // 遍历检测是否超时未归还
 // pConn->isTimeout(); // 当前时间 - 被请求的时间
@@ -3,31 +3,61 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 #include <map>
 #include <stdint.h>
 
 #include <mysql.h> 
 
 #define MAX_ESCAPE_STRING_LEN	10240
+#define DB_STMT_CACHE_SIZE		32		// 每个连接缓存的预处理语句个数
 
 using namespace std;
 
+// MYSQL_BIND 里 is_null/error 的类型: mysql 8.0 是 bool，5.7 和 MariaDB 是 my_bool
+#if defined(MARIADB_BASE_VERSION) || defined(MARIADB_VERSION_ID) || MYSQL_VERSION_ID < 80000
+typedef my_bool	db_bool;
+#else
+typedef bool	db_bool;
+#endif
+
+// 不拷贝的字符串，指向结果集里的内存，下一次 Next/Fetch 之前有效(C++11 没有 string_view)
+struct CStrRef {
+	const char*		data;
+	unsigned long	size;
+	string ToString() const { return data ? string(data, size) : string(); }
+};
+
 // 返回结果 select的时候用
 class CResultSet {
 public:
-	CResultSet(MYSQL_RES* res);
+	CResultSet(MYSQL_RES* res, MYSQL* mysql = NULL);
 	virtual ~CResultSet();
 
-	bool Next();
+	bool Next();		// 没有下一行返回 false，流式读取时出错也返回 false，要用 GetErrno 区分
+	unsigned int GetErrno() { return m_errno; }	// 0 表示正常读完
 	int GetInt(const char* key);
 	char* GetString(const char* key);
+
+	// 先用列名取一次下标，循环里按下标取值，不再每行查 map
+	int GetIndex(const char* key) { return _GetIndex(key); }
+	bool IsNull(int idx);
+	int64_t GetInt64(int idx);
+	double GetDouble(int idx);
+	CStrRef GetStrRef(int idx);
 private:
 	int _GetIndex(const char* key);
 
 	MYSQL_RES* 			m_res;
+	MYSQL*				m_mysql;	// 流式读取时用来判断是读完了还是出错
 	MYSQL_ROW			m_row;
+	unsigned long*		m_lengths;	// 当前行每列的长度
+	int					m_num_fields;
+	unsigned int		m_errno;	// Next 读取出错时的 mysql_errno
 	map<string, int>	m_key_map;
 };
 
@@ -46,13 +76,82 @@ public:
 
 	bool ExecuteUpdate();
 	uint32_t GetInsertId();
+
+	// 查询: 结果按列类型绑定到二进制缓冲区，整数和浮点数不经过文本转换
+	bool ExecuteQuery();
+	bool Fetch();		// 下一行
+	int GetIndex(const char* key);
+	bool IsNull(int idx);
+	int64_t GetInt64(int idx);
+	double GetDouble(int idx);
+	CStrRef GetStrRef(int idx);	// 字符串、时间、decimal 列，数值列返回空
 private:
+	friend class CDBConn;
+
+	void _FreeResult();
+
+	struct ResultColumn {
+		string			name;
+		enum_field_types type;		// 绑定的类型: MYSQL_TYPE_LONGLONG、MYSQL_TYPE_DOUBLE 或 MYSQL_TYPE_STRING
+		int64_t			int_value;
+		double			double_value;
+		vector<char>	buf;
+		unsigned long	length;
+		db_bool			is_null;
+		db_bool			error;
+	};
+
 	MYSQL_STMT*	m_stmt;
 	MYSQL_BIND*	m_param_bind;
 	uint32_t	m_param_cnt;
+	MYSQL_BIND*	m_result_bind;
+	vector<ResultColumn>	m_result_cols;
 };
 
 class CDBPool;
+class CDBConn;
+
+// 批量插入每次提交的结果
+struct DBBatchResult {
+	bool		ok;
+	uint32_t	rows;				// 这一批的行数
+	uint64_t	affected_rows;
+	uint64_t	first_insert_id;	// 这一批第一行的自增 id，同一条 insert 里是连续的
+};
+
+// 批量插入: 攒多行拼成一条 INSERT ... VALUES (...),(...)，一次往返插入多行。
+// 一批不超过服务端的 max_allowed_packet，也不超过 max_rows 行，到了自动提交；析构时提交剩下的
+class CBatchInsert {
+public:
+	// insert_head: "insert into IMUser(`salt`,`sex`,...)"
+	CBatchInsert(CDBConn* pDBConn, const string& insert_head, uint32_t max_rows = 1000);
+	virtual ~CBatchInsert();
+
+	void BeginRow();
+	void AddValue(const string& value);		// 会转义，加引号
+	void AddValue(int value);
+	void AddValue(uint32_t value);
+	void AddValue(int64_t value);
+	void AddValue(uint64_t value);
+	void AddNull();
+	bool EndRow();		// 一批满了就提交，提交失败或者这一行转义失败(丢弃，记一条失败结果)返回 false
+	bool Flush();		// 提交攒着的行
+
+	const vector<DBBatchResult>& GetResults() { return m_results; }
+	uint32_t GetFailedRows();
+private:
+	void _NextValue();
+
+	CDBConn*	m_pDBConn;
+	string		m_head;			// insert into t(...) values
+	string		m_sql;			// 攒着的一批
+	string		m_row;			// 正在拼的一行
+	uint32_t	m_rows = 0;		// m_sql 里的行数
+	uint32_t	m_max_rows;
+	size_t		m_max_bytes;
+	bool		m_row_bad = false;	// 正在拼的这一行有值转义失败
+	vector<DBBatchResult>	m_results;
+};
 
 class CDBConn {
 public:
@@ -64,8 +163,10 @@ public:
 	bool ExecuteCreate(const char* sql_query);
 	// 删除表
 	bool ExecuteDrop(const char* sql_query);
-	// 查询
-	CResultSet* ExecuteQuery(const char* sql_query);
+	// 查询，use_result 为 true 时边读边取(mysql_use_result)，不把整个结果放在内存里，
+	// 但是读完或者 delete 结果集之前这个连接不能执行别的语句；读到一半断线 Next 也返回 false，
+	// 循环结束后要检查 GetErrno()，不为 0 说明结果不完整
+	CResultSet* ExecuteQuery(const char* sql_query, bool use_result = false);
 
     /**
     *  执行DB更新，修改
@@ -86,11 +187,45 @@ public:
 	bool Rollback();
 	// 获取连接池名
 	const char* GetPoolName();
-	MYSQL* GetMysql() { return m_mysql; }
+	MYSQL* GetMysql() { return m_mysql; }	// 断线重连后会换成新的句柄，不要跨语句保存
+
+	// 取预处理语句，同一条 SQL 只 prepare 一次，语句属于连接，不要 delete。
+	// 在归还连接之前有效，并且之后取的不同 SQL 不超过 DB_STMT_CACHE_SIZE 条
+	CPrepareStatement* GetPrepareStatement(const string& sql);
+	// 这次借出以来经过 _Query 的语句数和 mysql_real_query 总耗时 us，CDBRouter 用来算延迟
+	uint32_t GetQueryCount() { return m_query_cnt; }
+	uint64_t GetQueryTimeUs() { return m_query_us; }
+
+	enum { CONN_FREE = 0, CONN_USED = 1 };
 private:
+	friend class CDBPool;
+	friend class CBatchInsert;
+
+	bool		_Query(const char* sql_query, unsigned long len);
+	bool		_Reconnect();
+	bool		_Ping();
+	uint32_t	_GetMaxPacket();
+	void		_ClearStmtCache();
+
 	CDBPool* 	m_pDBPool;	// to get MySQL server information
 	MYSQL* 		m_mysql;	// 对应一个连接
 	char		m_escape_string[MAX_ESCAPE_STRING_LEN + 1];
+	bool		m_in_trans = false;	// 事务中断线不能重试，重连后事务已经没了
+
+	// 预处理语句 LRU，表头是最近用的。重连后服务端的语句都没了，按 mysql_thread_id 判断重连过没有
+	typedef list<pair<string, CPrepareStatement*> > StmtList;
+	StmtList	m_stmt_lru;
+	map<string, StmtList::iterator>	m_stmt_map;
+	unsigned long	m_stmt_thread_id = 0;
+	uint32_t	m_max_packet = 0;	// 服务端 max_allowed_packet，第一次批量插入时查询
+
+	// 以下由 CDBPool 维护
+	uint32_t	m_index = 0;	// 在 CDBPool::m_conns 中的下标
+	std::atomic<uint32_t> m_next{0};	// 空闲栈中下一个连接的下标+1，0 表示栈底
+	std::atomic<int> m_state{CONN_FREE};	// 借出还是空闲，归还时用来判断重复归还
+	uint64_t	m_last_used = 0;	// 上次归还的时间 ms，空闲太久的借出时先 ping
+	uint32_t	m_query_cnt = 0;	// 借出时清零
+	uint64_t	m_query_us = 0;
 };
 
 class CDBPool {	// 只是负责管理连接CDBConn，真正干活的是CDBConn
@@ -101,9 +236,11 @@ public:
 			int max_conn_cnt);
 	virtual 	~CDBPool();
 
-	int 		Init();		// 连接数据库，创建连接
+	void		SetMinIdle(int min_idle);	// Init 之前调用，保持的最少空闲连接数，默认 MIN_DB_CONN_CNT
+	void		SetPingIdle(int idle_ms) { m_ping_idle_ms = idle_ms; }	// 空闲超过 idle_ms 的连接借出时先 mysql_ping，0 每次都 ping，-1 不 ping
+	int 		Init();		// 连接数据库，并行创建 min_idle 个连接，启动后台建连线程
 	CDBConn* 	GetDBConn(const int timeout_ms = 0);	// 获取连接资源
-	void 		RelDBConn(CDBConn* pConn);	// 归还连接资源
+	bool 		RelDBConn(CDBConn* pConn);	// 归还连接资源，重复归还返回 false
 
 	const char* GetPoolName() { return m_pool_name.c_str(); }
 	const char* GetDBServerIP() { return m_db_server_ip.c_str(); }
@@ -111,22 +248,48 @@ public:
 	const char* GetUsername() { return m_username.c_str(); }
 	const char* GetPasswrod() { return m_password.c_str(); }
 	const char* GetDBName() { return m_db_name.c_str(); }
+	int			GetIdleCount() { return m_idle_cnt; }	// 空闲连接数，近似值
+	uint32_t	GetConnectFailures() { return m_fill_fail; }	// 建连失败的次数，只增不减，比较前后两次的值判断有没有连不上
 private:
+	CDBConn*	_CreateConn();
+	int			_CreateConns(int n);
+	void		_PushFree(CDBConn* pConn);
+	CDBConn*	_PopFree();
+	void		_PutFree(CDBConn* pConn);
+	void		_KickFiller();
+	void		_FillLoop();
+
 	string 		m_pool_name;	// 连接池名称
 	string 		m_db_server_ip;	// 数据库ip
 	uint16_t	m_db_server_port; // 数据库端口
 	string 		m_username;  	// 用户名
 	string 		m_password;		// 用户密码
 	string 		m_db_name;		// db名称
-	int			m_db_cur_conn_cnt;	// 当前启用的连接数量
-	int 		m_db_max_conn_cnt;	// 最大连接数量
-	list<CDBConn*>	m_free_list;	// 空闲的连接
+	std::atomic<int> m_db_cur_conn_cnt{0};	// 当前启用的连接数量(包括正在建立的)
+	int 		m_db_max_conn_cnt = 0;	// 最大连接数量
+	vector<CDBConn*>	m_conns;	// 所有建立好的连接，按下标存放，最多 m_db_max_conn_cnt 个
+	std::atomic<uint32_t> m_conn_slot{0};	// 下一个连接的下标
+	std::atomic<uint64_t> m_free_top{0};	// 空闲连接栈: 高 32 位版本号，低 32 位栈顶下标+1
+	std::atomic<int> m_waiters{0};	// 在 m_cond_var 上等待的线程数
+	std::atomic<int> m_idle_cnt{0};	// 空闲栈里的连接数，近似值
+
+	// 后台建连: GetDBConn 不自己做 TCP + 认证握手，交给 m_filler
+	int			m_min_idle = 0;		// 至少保持的空闲连接数
+	int			m_burst = 0;		// 突发时额外预留的空闲连接数，有缺口就翻倍，空闲时减半
+	std::thread	m_filler;
+	std::mutex	m_fill_mutex;
+	std::condition_variable m_fill_cond;
+	std::atomic<bool> m_fill_kick{false};	// 需要补充连接
+	std::atomic<int> m_misses{0};			// 上次补充以后取不到空闲连接的次数
+	std::atomic<uint32_t> m_fill_fail{0};	// 建连失败的次数，等待方用来判断要不要放弃
 
 	list<CDBConn*>	m_used_list;		// 记录已经被请求的连接
 	std::mutex m_mutex;
     std::condition_variable m_cond_var;
-	bool m_abort_request = false;
+	std::atomic<bool> m_abort_request{false};
 	int wait_cout = 0;  // ./test_dbpool 4 1 1
+	int m_ping_idle_ms = 30000;	// 小于 mysql 的 wait_timeout，刚用过的连接不再 ping
+	int m_trace_id = 0;	// memleak 里注册的编号，0 表示没有跟踪
 };
 
 #endif /* DBPOOL_H_ */
@@ -0,0 +1,319 @@
+#include "DBRouter.h"
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <chrono>
+
+#define log_error printf
+#define log_warn printf
+#define log_info printf
+
+#define MIN_LATENCY_SAMPLES 16	// 至少统计这么多次才判断是否摘除
+
+static uint64_t get_tick_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CDBRouter::CDBRouter(const char *router_name)
+{
+	m_router_name = router_name;
+}
+
+CDBRouter::~CDBRouter()
+{
+	for (map<string, DBNode *>::iterator it = m_nodes.begin(); it != m_nodes.end(); it++)
+	{
+		delete it->second->pool;
+		delete it->second;
+	}
+	m_nodes.clear();
+	m_replicas.clear();
+	m_primary = NULL;
+}
+
+int CDBRouter::_AddNode(CDBPool *pPool, bool primary)
+{
+	if (!pPool || m_nodes.find(pPool->GetPoolName()) != m_nodes.end())
+	{
+		log_error("db router: %s, add pool failed\n", m_router_name.c_str());
+		return 1;
+	}
+
+	DBNode *node = new DBNode();
+	node->pool = pPool;
+	node->primary = primary;
+	m_nodes[pPool->GetPoolName()] = node;
+
+	if (primary)
+	{
+		m_primary = node;
+	}
+	else
+	{
+		m_replicas.push_back(node);
+	}
+	return 0;
+}
+
+int CDBRouter::SetPrimary(CDBPool *pPool)
+{
+	if (m_primary)
+	{
+		log_error("db router: %s, primary already set: %s\n", m_router_name.c_str(), m_primary->pool->GetPoolName());
+		return 1;
+	}
+	return _AddNode(pPool, true);
+}
+
+int CDBRouter::AddReplica(CDBPool *pPool)
+{
+	return _AddNode(pPool, false);
+}
+
+CDBPool *CDBRouter::GetPool(const char *pool_name)
+{
+	map<string, DBNode *>::iterator it = m_nodes.find(pool_name);
+	return it == m_nodes.end() ? NULL : it->second->pool;
+}
+
+// 摘除时间到了重新开始统计，统计够了之前不会再被摘除
+bool CDBRouter::_Available(DBNode *node, uint64_t now)
+{
+	uint64_t until = node->eject_until;
+	if (until == 0)
+	{
+		return true;
+	}
+	if (now < until)
+	{
+		return false;
+	}
+
+	if (node->eject_until.compare_exchange_strong(until, 0))
+	{
+		node->latency_x8 = 0;
+		node->samples = 0;
+		log_info("db router: %s, replica %s back\n", m_router_name.c_str(), node->pool->GetPoolName());
+	}
+	return true;
+}
+
+CDBConn *CDBRouter::_GetConn(DBNode *node, const int timeout_ms)
+{
+	node->outstanding++;
+	CDBConn *pConn = node->pool->GetDBConn(timeout_ms);
+	if (!pConn)
+	{
+		node->outstanding--;
+	}
+	return pConn;
+}
+
+CDBConn *CDBRouter::GetWriteConn(const int timeout_ms)
+{
+	if (!m_primary)
+	{
+		log_error("db router: %s, no primary\n", m_router_name.c_str());
+		return NULL;
+	}
+	return _GetConn(m_primary, timeout_ms);
+}
+
+// 还剩 left 次尝试，每次等剩下时间的 1/left；timeout_ms 不大于 0 表示死等，原样传下去
+static int split_timeout(int timeout_ms, uint64_t start, int left)
+{
+	if (timeout_ms <= 0)
+	{
+		return timeout_ms;
+	}
+	int remain = timeout_ms - (int)(get_tick_ms() - start);
+	int wait_ms = remain / left;
+	return wait_ms > 0 ? wait_ms : 1;	// 0 是死等，至少等 1ms
+}
+
+/*
+ * 优先选有空闲连接的从库，再选借出最少的(least outstanding)，一样时从 m_rr 开始轮流，不会总压在第一个上。
+ * 取不到连接就试下一个没试过的从库，最后用主库，timeout_ms 分给剩下的每次尝试，总共不会等太久。
+ * 只有连不上(建连失败)的从库摘除；连接都借出去了等超时只是忙，不摘除。
+ */
+CDBConn *CDBRouter::GetReadConn(const int timeout_ms)
+{
+	uint64_t start = get_tick_ms();
+	size_t n = m_replicas.size();
+	vector<bool> tried(n, false);
+
+	for (;;)
+	{
+		DBNode *best = NULL;
+		size_t best_i = 0;
+		bool best_idle = false;
+		int best_outstanding = 0;
+		int left = 0;	// 还能试的从库
+		uint64_t now = get_tick_ms();
+		size_t rr = n ? m_rr++ % n : 0;
+		for (size_t k = 0; k < n; k++)
+		{
+			size_t i = (rr + k) % n;
+			DBNode *node = m_replicas[i];
+			if (tried[i] || !_Available(node, now))
+			{
+				continue;
+			}
+			left++;
+			bool idle = node->pool->GetIdleCount() > 0;
+			int outstanding = node->outstanding;
+			if (!best || (idle && !best_idle) || (idle == best_idle && outstanding < best_outstanding))
+			{
+				best = node;
+				best_i = i;
+				best_idle = idle;
+				best_outstanding = outstanding;
+			}
+		}
+
+		if (!best)
+		{
+			break;	// 从库都试过了或者被摘除了
+		}
+
+		tried[best_i] = true;
+		uint32_t fails = best->pool->GetConnectFailures();
+		CDBConn *pConn = _GetConn(best, split_timeout(timeout_ms, start, left + 1));	// 加上最后的主库
+		if (pConn)
+		{
+			return pConn;
+		}
+
+		if (best->pool->GetConnectFailures() != fails)
+		{
+			best->eject_until = get_tick_ms() + m_eject_ms;
+			best->ejects++;
+			log_warn("db router: %s, replica %s connect failed, eject %dms\n", m_router_name.c_str(), best->pool->GetPoolName(), m_eject_ms);
+		}
+	}
+
+	return GetWriteConn(split_timeout(timeout_ms, start, 1));
+}
+
+// sql 里有没有 words 这几个连续的词，词之间可以是任意空白，不区分大小写
+static bool has_words(const char *sql, const char *const *words, int n)
+{
+	size_t len0 = strlen(words[0]);
+	for (const char *p = sql; (p = strcasestr(p, words[0])) != NULL; p++)
+	{
+		if (p > sql && (isalnum((unsigned char)p[-1]) || p[-1] == '_'))
+		{
+			continue;	// 是别的词的一部分
+		}
+		const char *q = p + len0;
+		int i = 1;
+		for (; i < n; i++)
+		{
+			if (!isspace((unsigned char)*q))
+			{
+				break;
+			}
+			while (isspace((unsigned char)*q))
+			{
+				q++;
+			}
+			size_t len = strlen(words[i]);
+			if (strncasecmp(q, words[i], len) != 0)
+			{
+				break;
+			}
+			q += len;
+		}
+		if (i == n && !isalnum((unsigned char)*q) && *q != '_')
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// 只看第一个词: select 走从库，加锁读(for update、for share、lock in share mode)也走主库
+CDBConn *CDBRouter::GetConn(const char *sql_query, const int timeout_ms)
+{
+	static const char *const for_update[] = { "for", "update" };
+	static const char *const for_share[] = { "for", "share" };
+	static const char *const lock_share[] = { "lock", "in", "share", "mode" };
+
+	while (isspace((unsigned char)*sql_query) || *sql_query == '(')
+	{
+		sql_query++;
+	}
+
+	if (strncasecmp(sql_query, "select", 6) == 0 && !has_words(sql_query, for_update, 2)
+		&& !has_words(sql_query, for_share, 2) && !has_words(sql_query, lock_share, 4))
+	{
+		return GetReadConn(timeout_ms);
+	}
+	return GetWriteConn(timeout_ms);
+}
+
+void CDBRouter::RelDBConn(CDBConn *pConn)
+{
+	if (!pConn)
+	{
+		log_error("pConn is null");
+		return;
+	}
+
+	map<string, DBNode *>::iterator it = m_nodes.find(pConn->GetPoolName());
+	if (it == m_nodes.end())
+	{
+		log_error("db router: %s, unknown pool %s\n", m_router_name.c_str(), pConn->GetPoolName());
+		return;
+	}
+
+	DBNode *node = it->second;
+	// 归还之后连接可能马上被别的线程借走，先取统计
+	uint32_t queries = pConn->GetQueryCount();
+	uint64_t query_us = pConn->GetQueryTimeUs();
+	if (!node->pool->RelDBConn(pConn))
+	{
+		return;		// 重复归还，借出计数在第一次归还时已经减过了
+	}
+	node->outstanding--;
+
+	if (queries == 0)
+	{
+		return;		// 没有执行语句，不算延迟
+	}
+
+	// 指数平均，新样本占 1/8。并发更新丢掉一两个样本没有关系
+	int sample = (int)(query_us / queries);
+	int latency_x8 = node->latency_x8;
+	latency_x8 += sample - latency_x8 / 8;
+	node->latency_x8 = latency_x8;
+	int latency_us = latency_x8 / 8;
+	int samples = ++node->samples;
+
+	if (!node->primary && samples >= MIN_LATENCY_SAMPLES && latency_us > m_slow_ms * 1000 && node->eject_until == 0)
+	{
+		uint64_t expected = 0;
+		if (node->eject_until.compare_exchange_strong(expected, get_tick_ms() + m_eject_ms))
+		{
+			node->ejects++;
+			log_warn("db router: %s, replica %s latency %.2fms > %dms, eject %dms\n", m_router_name.c_str(),
+					 node->pool->GetPoolName(), latency_us / 1000.0, m_slow_ms, m_eject_ms);
+		}
+	}
+}
+
+void CDBRouter::Dump()
+{
+	uint64_t now = get_tick_ms();
+	printf("db router: %s\n", m_router_name.c_str());
+	for (map<string, DBNode *>::iterator it = m_nodes.begin(); it != m_nodes.end(); it++)
+	{
+		DBNode *node = it->second;
+		uint64_t until = node->eject_until;
+		printf("  %-16s %-7s outstanding:%d latency:%.2fms ejects:%u%s\n", it->first.c_str(),
+			   node->primary ? "primary" : "replica", (int)node->outstanding, node->latency_x8 / 8000.0,
+			   (uint32_t)node->ejects, until > now ? " ejected" : "");
+	}
+}
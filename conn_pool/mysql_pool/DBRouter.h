@@ -0,0 +1,62 @@
+#ifndef DBROUTER_H_
+#define DBROUTER_H_
+
+#include <atomic>
+#include <vector>
+#include <map>
+#include <string>
+#include "DBPool.h"
+
+/*
+ * 读写分离: 一个主库加多个从库，每个库一个 CDBPool，按 GetPoolName() 的名字管理。
+ * 写和事务走主库；读走从库，选借出连接最少的，延迟变大的从库暂时摘除，
+ * 从库都不可用时读也走主库。
+ * 延迟是每次借出期间经过 CDBConn::_Query 的语句(ExecuteQuery/ExecuteUpdate 等)平均往返时间，
+ * 不包括调用方处理结果的时间；只用预处理语句的借出不计入。
+ * SetPrimary/AddReplica 要在多线程使用之前调用。
+ */
+class CDBRouter {
+public:
+	CDBRouter(const char* router_name);
+	virtual ~CDBRouter();	// 释放所有的池
+
+	// 池交给 router 管理，名字不能重复，成功返回 0
+	int SetPrimary(CDBPool* pPool);
+	int AddReplica(CDBPool* pPool);
+	CDBPool* GetPool(const char* pool_name);
+
+	// 平均延迟超过 slow_ms 的从库摘除 eject_ms，之后重新统计
+	void SetEjectPolicy(int slow_ms, int eject_ms) { m_slow_ms = slow_ms; m_eject_ms = eject_ms; }
+
+	CDBConn* GetReadConn(const int timeout_ms = 0);		// 从库
+	CDBConn* GetWriteConn(const int timeout_ms = 0);	// 主库，事务也用它
+	CDBConn* GetConn(const char* sql_query, const int timeout_ms = 0);	// select 走从库，其他走主库
+	void RelDBConn(CDBConn* pConn);		// 归还到借出的池，记录延迟
+
+	const char* GetRouterName() { return m_router_name.c_str(); }
+	void Dump();	// 打印每个库的借出数、平均延迟和是否被摘除
+private:
+	struct DBNode {
+		CDBPool*			pool;
+		bool				primary;
+		std::atomic<int>	outstanding{0};		// 借出去还没有归还的连接
+		std::atomic<int>	latency_x8{0};		// 平均延迟 us 的 8 倍，小于 8us 的样本也能累积
+		std::atomic<int>	samples{0};			// 这次统计的次数，太少不摘除
+		std::atomic<uint64_t>	eject_until{0};	// 摘除到什么时候，ms
+		std::atomic<uint32_t>	ejects{0};		// 被摘除的次数
+	};
+
+	int			_AddNode(CDBPool* pPool, bool primary);
+	CDBConn*	_GetConn(DBNode* node, const int timeout_ms);
+	bool		_Available(DBNode* node, uint64_t now);
+
+	string				m_router_name;
+	DBNode*				m_primary = NULL;
+	vector<DBNode*>		m_replicas;
+	map<string, DBNode*>	m_nodes;	// 池名 -> 库
+	std::atomic<uint32_t>	m_rr{0};	// 借出数相同时轮流选
+	int					m_slow_ms = 200;
+	int					m_eject_ms = 10000;
+};
+
+#endif /* DBROUTER_H_ */
@@ -14,8 +14,8 @@ bool insertUser(CDBConn *pDBConn, int id)
     strSql = "insert into IMUser(`salt`,`sex`,`nick`,`password`,`domain`,`name`,`phone`,`email`,`company`,`address`,`avatar`,`sign_info`,`departId`,`status`,`created`,`updated`) values(?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
     int id_index = id;      // 用来区别姓名
     
-    CPrepareStatement *stmt = new CPrepareStatement();
-    if (stmt->Init(pDBConn->GetMysql(), strSql))
+    CPrepareStatement *stmt = pDBConn->GetPrepareStatement(strSql);  // 连接里缓存，同一条 SQL 只 prepare 一次
+    if (stmt)
     {
         uint32_t nNow = (uint32_t)time(NULL);
         uint32_t index = 0;
@@ -46,13 +46,18 @@ bool insertUser(CDBConn *pDBConn, int id)
         string strCompany = "零声学院";           //公司
         string strAddress = "长沙岳麓区雅阁国际"; //地址
 
+        // SetParam 只记下地址，参数要活到 ExecuteUpdate 之后，不能传临时对象
+        string strDomainId = strDomain + int2string(id_index);
+        string strNameId = strName + int2string(id_index);
+        string strTelId = strTel + int2string(id_index);
+
         stmt->SetParam(index++, strSalt);
         stmt->SetParam(index++, nSex);
         stmt->SetParam(index++, strNick);
         stmt->SetParam(index++, strOutPass);
-        stmt->SetParam(index++, (strDomain + int2string(id_index)));
-        stmt->SetParam(index++, (strName + int2string(id_index)));
-        stmt->SetParam(index++, (strTel+ int2string(id_index)));
+        stmt->SetParam(index++, strDomainId);
+        stmt->SetParam(index++, strNameId);
+        stmt->SetParam(index++, strTelId);
         stmt->SetParam(index++, strEmail);
         stmt->SetParam(index++, strCompany);
         stmt->SetParam(index++, strAddress);
@@ -74,7 +79,6 @@ bool insertUser(CDBConn *pDBConn, int id)
             // printf("register then get user_id:%d\n", nId);
         }
     }
-    delete stmt;
 
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <time.h>
+#include "DBAsync.h"
+
+using namespace std;
+
+// 一个线程通过 reactor 在多个连接上同时执行查询，和 test_dbpool 的多线程同步查询对比
+// ./test_async [查询数量] [连接数量]
+
+#define DB_HOST_IP "127.0.0.1" // 数据库服务器ip
+#define DB_HOST_PORT 3306
+#define DB_DATABASE_NAME "mysql_pool_test" // 数据库对应的库名字, 这里需要自己提前用命令创建完毕
+#define DB_USERNAME "root"                 // 数据库用户名
+#define DB_PASSWORD "123456"               // 数据库密码
+#define DB_POOL_NAME "mysql_async"         // 连接池的名字
+#define DB_ASYNC_CONN 32                   // 连接数量，也就是同时在执行的查询数量
+
+static reactor_t *R;
+static int cnt, failed, before, num;
+
+int current_tick() {
+    int t = 0;
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    t = (int)ti.tv_sec * 1000;
+    t += ti.tv_nsec / 1000000;
+    return t;
+}
+
+void queryCallback(CResultSet *result_set, int err, void *privdata)
+{
+    ((void)privdata);
+    if (err)
+    {
+        failed++;
+    }
+    else if (result_set && result_set->Next())
+    {
+        // printf("id:%ld\n", (long)result_set->GetInt64(0));
+    }
+
+    cnt++;
+    if (cnt == num)
+    {
+        int used = current_tick() - before;
+        printf("after %d exec mysql query, failed %d, used %d ms\n", num, failed, used);
+        stop_eventloop(R);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    num = (argc > 1) ? atoi(argv[1]) : 10000;
+    int conn_cnt = (argc > 2) ? atoi(argv[2]) : DB_ASYNC_CONN;
+
+    R = create_reactor();
+    CDBAsyncPool *pPool = new CDBAsyncPool(R, DB_POOL_NAME, DB_HOST_IP, DB_HOST_PORT,
+                                           DB_USERNAME, DB_PASSWORD, DB_DATABASE_NAME, conn_cnt);
+    if (pPool->Init())
+    {
+        printf("init db async pool failed: %s\n", DB_POOL_NAME);
+        return -1;
+    }
+
+    // 连接还没建立好也可以先排队
+    before = current_tick();
+    for (int i = 0; i < num; i++)
+    {
+        pPool->Query("select 1", queryCallback, NULL);
+    }
+
+    eventloop(R);
+
+    delete pPool;
+    release_reactor(R);
+    cout << "main finish!" << endl;
+    return 0;
+}
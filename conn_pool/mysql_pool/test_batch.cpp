@@ -0,0 +1,160 @@
+#include <iostream>
+#include <sys/time.h>
+#include "DBPool.h"
+#include "IMUser.h"
+
+using namespace std;
+
+// 对比一行一条 insert 和 CBatchInsert 多行 insert 的插入速度
+// ./test_batch [行数]
+
+#define ROW_NUMBER 10000
+
+#define DB_HOST_IP "127.0.0.1" // 数据库服务器ip
+#define DB_HOST_PORT 3306
+#define DB_DATABASE_NAME "mysql_pool_test" // 数据库对应的库名字, 这里需要自己提前用命令创建完毕
+#define DB_USERNAME "root"                 // 数据库用户名
+#define DB_PASSWORD "123456"               // 数据库密码
+#define DB_POOL_NAME "mysql_pool"          // 连接池的名字，便于将多个连接池集中管理
+#define DB_POOL_MAX_CON 1                  // 只用一个连接，比较的是单连接的往返次数
+
+#define INSERT_IMUSER_HEAD "insert into IMUser(`salt`,`sex`,`nick`,`password`,`domain`,`name`,`phone`,`email`,`company`,`address`,`avatar`,`sign_info`,`departId`,`status`,`created`,`updated`)"
+
+static uint64_t get_tick_count()
+{
+    struct timeval tval;
+    uint64_t ret_tick;
+
+    gettimeofday(&tval, NULL);
+
+    ret_tick = tval.tv_sec * 1000L + tval.tv_usec / 1000L;
+    return ret_tick;
+}
+
+static bool resetTable(CDBConn *pDBConn)
+{
+    pDBConn->ExecuteDrop(DROP_IMUSER_TABLE);
+    if (!pDBConn->ExecuteCreate(CREATE_IMUSER_TABLE))
+    {
+        printf("ExecuteCreate failed\n");
+        return false;
+    }
+    return true;
+}
+
+static void printSpeed(const char *name, int row_num, uint64_t ms)
+{
+    if (ms == 0)
+    {
+        ms = 1;
+    }
+    printf("%-16s rows:%d need time:%lums, %.0f rows/s\n", name, row_num, (unsigned long)ms, row_num * 1000.0 / ms);
+}
+
+// 现有的方式: 每行一次预处理语句执行，一行一个往返
+int testPerRow(CDBConn *pDBConn, int row_num)
+{
+    if (!resetTable(pDBConn))
+    {
+        return -1;
+    }
+
+    uint64_t start_time = get_tick_count();
+    for (int i = 0; i < row_num; i++)
+    {
+        insertUser(pDBConn, i);
+    }
+    printSpeed("per row", row_num, get_tick_count() - start_time);
+    return 0;
+}
+
+// 多行 insert，每 batch_rows 行一个往返
+int testBatch(CDBConn *pDBConn, int row_num, uint32_t batch_rows)
+{
+    if (!resetTable(pDBConn))
+    {
+        return -1;
+    }
+
+    uint32_t nNow = (uint32_t)time(NULL);
+    string strOutPass = "987654321";
+    string strSalt = "abcd";
+    string strNick = "minghua";
+    string strEmail = "326873713@qq.com";
+    string strCompany = "零声学院";
+    string strAddress = "长沙岳麓区雅阁国际";
+    string sign_info = "一切只为你";
+
+    uint64_t start_time = get_tick_count();
+    CBatchInsert *batch = new CBatchInsert(pDBConn, INSERT_IMUSER_HEAD, batch_rows);
+    for (int i = 0; i < row_num; i++)
+    {
+        batch->BeginRow();
+        batch->AddValue(strSalt);
+        batch->AddValue(1);
+        batch->AddValue(strNick);
+        batch->AddValue(strOutPass);
+        batch->AddValue("廖庆富" + int2string(i));
+        batch->AddValue("xioaming" + int2string(i));
+        batch->AddValue("1857036" + int2string(i));
+        batch->AddValue(strEmail);
+        batch->AddValue(strCompany);
+        batch->AddValue(strAddress);
+        batch->AddValue(string(""));
+        batch->AddValue(sign_info);
+        batch->AddValue((uint32_t)0);
+        batch->AddValue(0);
+        batch->AddValue(nNow);
+        batch->AddValue(nNow);
+        batch->EndRow();
+    }
+    batch->Flush();
+    uint64_t need_time = get_tick_count() - start_time;
+
+    char name[32];
+    snprintf(name, sizeof(name), "batch %u", batch_rows);
+    printSpeed(name, row_num, need_time);
+
+    const vector<DBBatchResult> &results = batch->GetResults();
+    if (!results.empty())
+    {
+        printf("  batches:%lu, failed rows:%u, first batch: rows:%u affected:%lu first_id:%lu\n",
+               (unsigned long)results.size(), batch->GetFailedRows(), results[0].rows,
+               (unsigned long)results[0].affected_rows, (unsigned long)results[0].first_insert_id);
+    }
+    delete batch;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int row_num = (argc > 1) ? atoi(argv[1]) : ROW_NUMBER;
+
+    CDBPool *pDBPool = new CDBPool(DB_POOL_NAME, DB_HOST_IP, DB_HOST_PORT,
+                                   DB_USERNAME, DB_PASSWORD, DB_DATABASE_NAME, DB_POOL_MAX_CON);
+    if (pDBPool->Init())
+    {
+        printf("init db instance failed: %s\n", DB_POOL_NAME);
+        return -1;
+    }
+
+    CDBConn *pDBConn = pDBPool->GetDBConn();
+    if (!pDBConn)
+    {
+        printf("GetDBConn failed\n");
+        return -1;
+    }
+
+    testPerRow(pDBConn, row_num);
+
+    uint32_t batch_tbl[] = {10, 100, 1000};
+    for (int i = 0; i < int(sizeof(batch_tbl) / sizeof(batch_tbl[0])); i++)
+    {
+        testBatch(pDBConn, row_num, batch_tbl[i]);
+    }
+
+    pDBPool->RelDBConn(pDBConn);
+    delete pDBPool;
+    cout << "main finish!" << endl;
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <sys/time.h>
+#include "DBRouter.h"
+
+using namespace std;
+
+// CDBRouter 读写分离: 一个主库两个从库，再加一个连不上的从库，看它被摘除
+// 本机只有一个 mysql 时主库从库都连同一个库，只是池名不同
+// ./test_router [线程数] [每个线程的查询数]
+
+#define THREAD_NUM 4
+#define QUERY_NUMBER 1000
+
+#define DB_HOST_IP "127.0.0.1" // 数据库服务器ip
+#define DB_HOST_PORT 3306
+#define DB_BAD_PORT 3307                   // 没有 mysql 监听的端口，模拟连不上的从库
+#define DB_DATABASE_NAME "mysql_pool_test" // 数据库对应的库名字, 这里需要自己提前用命令创建完毕
+#define DB_USERNAME "root"                 // 数据库用户名
+#define DB_PASSWORD "123456"               // 数据库密码
+#define DB_ROUTER_NAME "mysql_router"
+#define DB_POOL_MAX_CON 4                  // 每个库的连接数
+
+static uint64_t get_tick_count()
+{
+    struct timeval tval;
+    uint64_t ret_tick;
+
+    gettimeofday(&tval, NULL);
+
+    ret_tick = tval.tv_sec * 1000L + tval.tv_usec / 1000L;
+    return ret_tick;
+}
+
+static CDBPool *createPool(const char *pool_name, uint16_t port)
+{
+    CDBPool *pDBPool = new CDBPool(pool_name, DB_HOST_IP, port,
+                                   DB_USERNAME, DB_PASSWORD, DB_DATABASE_NAME, DB_POOL_MAX_CON);
+    if (pDBPool->Init())
+    {
+        printf("init db instance failed: %s\n", pool_name); // 还是交给 router，看它被摘除
+    }
+    return pDBPool;
+}
+
+// 打印语句被分到哪个库
+static void checkRoute(CDBRouter *router, const char *sql)
+{
+    CDBConn *pDBConn = router->GetConn(sql, 1000);
+    printf("%-56s -> %s\n", sql, pDBConn ? pDBConn->GetPoolName() : "NULL");
+    if (pDBConn)
+    {
+        router->RelDBConn(pDBConn);
+    }
+}
+
+static void queryWorker(CDBRouter *router, int query_num, atomic<int> *failed)
+{
+    for (int i = 0; i < query_num; i++)
+    {
+        CDBConn *pDBConn = router->GetConn("select 1", 1000);
+        if (!pDBConn)
+        {
+            (*failed)++;
+            continue;
+        }
+        CResultSet *pResultSet = pDBConn->ExecuteQuery("select 1");
+        if (pResultSet)
+        {
+            while (pResultSet->Next())
+            {
+            }
+            delete pResultSet;
+        }
+        else
+        {
+            (*failed)++;
+        }
+        router->RelDBConn(pDBConn);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int thread_num = (argc > 1) ? atoi(argv[1]) : THREAD_NUM;
+    int query_num = (argc > 2) ? atoi(argv[2]) : QUERY_NUMBER;
+
+    CDBRouter *router = new CDBRouter(DB_ROUTER_NAME);
+    router->SetPrimary(createPool("mysql_master", DB_HOST_PORT));
+    router->AddReplica(createPool("mysql_slave1", DB_HOST_PORT));
+    router->AddReplica(createPool("mysql_slave2", DB_HOST_PORT));
+    router->AddReplica(createPool("mysql_slave_bad", DB_BAD_PORT));
+
+    // 加锁读不管怎么换行、大小写都走主库
+    checkRoute(router, "select name from IMUser where id = 1");
+    checkRoute(router, "SELECT name FROM IMUser WHERE id = 1 FOR\n  UPDATE");
+    checkRoute(router, "select name from IMUser where id = 1 for share");
+    checkRoute(router, "select name from IMUser where id = 1 lock in  share mode");
+    checkRoute(router, "select name from IMUser where sign_info = 'for updates'");
+    checkRoute(router, "update IMUser set status = 1 where id = 1");
+
+    atomic<int> failed{0};
+    uint64_t start_time = get_tick_count();
+    vector<thread> threads;
+    for (int i = 0; i < thread_num; i++)
+    {
+        threads.push_back(thread(queryWorker, router, query_num, &failed));
+    }
+    for (int i = 0; i < thread_num; i++)
+    {
+        threads[i].join();
+    }
+    printf("threads:%d, queries:%d, failed:%d, need time:%lums\n", thread_num, thread_num * query_num,
+           (int)failed, (unsigned long)(get_tick_count() - start_time));
+
+    router->Dump();
+    delete router;
+    cout << "main finish!" << endl;
+    return 0;
+}
@@ -55,6 +55,7 @@ int add_event(int epfd, int fd, int events, void *privdata) {
 
 int del_event(int epfd, int fd) {
 	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	return 0;	// 没有 return 在 C++ 里是未定义行为，-O2 下会跑飞
 }
 
 int enable_event(int epfd, int fd, void *privdata, int readable, int writeable) {
@@ -10,6 +10,9 @@
 #define MIN_CACHE_CONN_CNT 2
 #define MAX_CACHE_CONN_FAIL_NUM 10
 
+// -DMEMLEAK_POOL_TRACE: 借出/归还连接时通知 memleak_detect/memleak.c，报告借了没还的连接和调用栈
+#include "memleak.h"
+
 CacheConn::CacheConn(const char *server_ip, int server_port, int db_index, const char *password,
 					 const char *pool_name)
 {
@@ -723,6 +726,7 @@ CachePool::CachePool(const char *pool_name, const char *server_ip, int server_po
 	m_password = password;
 	m_max_conn_cnt = max_conn_cnt;
 	m_cur_conn_cnt = MIN_CACHE_CONN_CNT;
+	m_trace_id = MEMLEAK_POOL_REGISTER(pool_name);
 }
 
 CachePool::~CachePool()
@@ -730,6 +734,7 @@ CachePool::~CachePool()
 	std::lock_guard<std::mutex> lock(m_mutex);
 	m_abort_request = true;
 	m_cond_var.notify_all();		// 通知所有在等待的
+	MEMLEAK_POOL(unregister, m_trace_id);
 	for (list<CacheConn *>::iterator it = m_free_list.begin(); it != m_free_list.end(); it++)
 	{
 		CacheConn *pConn = *it;
@@ -828,6 +833,7 @@ CacheConn *CachePool::GetCacheConn(const int timeout_ms)
 
 	CacheConn *pConn = m_free_list.front();
 	m_free_list.pop_front();
+	MEMLEAK_POOL(get, m_trace_id, pConn, sizeof(CacheConn));
 
  
 
@@ -836,6 +842,8 @@ CacheConn *CachePool::GetCacheConn(const int timeout_ms)
 
 void CachePool::RelCacheConn(CacheConn *p_cache_conn)
 {
+	MEMLEAK_POOL(put, m_trace_id, p_cache_conn);	// 重复归还会记为 bad put
+
 	std::lock_guard<std::mutex> lock(m_mutex);
 	list<CacheConn *>::iterator it = m_free_list.begin();
 	for (; it != m_free_list.end(); it++)
@@ -122,6 +122,7 @@ private:
 	bool m_abort_request = false;
 
 	int wait_cout = 0; //这里只是为测试了测试用
+	int m_trace_id = 0;	// memleak 里注册的编号，0 表示没有跟踪
 };
 
 
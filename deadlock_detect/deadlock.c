@@ -1,5 +1,7 @@
 
 // build: gcc -o deadlock deadlock.c -lpthread -ldl
+// lock order mode: DEADLOCK_LOCKORDER=1 ./deadlock  (加 -rdynamic 可以打印出函数名)
+// profile mode: DEADLOCK_PROFILE=10 ./deadlock  (每 10 秒输出一次锁竞争统计，kill -USR2 随时输出)
 
 
 #define _GNU_SOURCE
@@ -8,8 +10,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/eventfd.h>
 
 #include <stdint.h>
 
@@ -20,10 +29,18 @@
 typedef unsigned long int uint64;
 
 
-#define MAX		100
+#define HASH_INIT_SIZE		64	// 哈希表初始容量，必须是 2 的幂
+#define PROFILE_DEPTH		6	// 有竞争时记录的调用栈深度
 
 enum Type {PROCESS, RESOURCE};
 
+// hook 记录的事件类型，低 4 位是类型，高位是标志
+enum EventType {LOCK_BEFORE, LOCK_AFTER, UNLOCK_AFTER, LOCK_DESTROY, LOCK_CANCEL, STACK_FRAMES};
+
+#define EVENT_TYPE_MASK		0x0f
+#define EVENT_SHARED		0x10	// 读锁
+#define EVENT_TRY		0x20	// trylock 拿到的锁
+
 struct source_type {
 
 	uint64 id;
@@ -31,56 +48,192 @@ struct source_type {
 
 	uint64 lock_id;
 	int degress;
+	uint64 ts;	// 锁: 持有者获得锁的时间; 线程: 最后一次处理的事件时间
+
+	uint64 *readers;	// 锁: 持有读锁的线程，递归读锁会重复出现; id 是写锁的持有者，没有为 0
+	int nreaders;
+	int readercap;
+};
+
+struct held_lock {
+
+	uint64 lock;
+	uint64 ip;	// 获得这把锁的调用点
+	uint64 ts;	// 获得的时间，性能分析模式算持有时间用
+
 };
 
 struct vertex {
 
 	struct source_type s;
-	struct vertex *next;
+	int shared;		// 等的是读锁，只会被写锁的持有者阻塞
+
+	struct held_lock *held;	// 线程当前持有的锁，只在锁顺序或性能分析模式下维护
+	int nheld;
+	int heldcap;
+
+	uint64 stack[PROFILE_DEPTH];	// 性能分析模式: 正在等的这次加锁的调用栈
+	int nstack;
+
+};
+
+// 开放寻址(线性探测)的哈希表: key(线程 id / 锁地址) -> 数组下标
+// key 为 0 表示空槽，装载超过一半时容量翻倍，删除时把后面的元素往前移，不留墓碑
+struct hash_table {
+
+	uint64 *keys;
+	int *vals;
+	int size;
+	int count;
 
 };
 
 struct task_graph {
 
-	struct vertex list[MAX];
+	struct vertex *list;		// 顶点数组，按需扩容
 	int num;
+	int cap;
+	struct hash_table vertex_index;	// 线程 id -> list 下标
 
-	struct source_type locklist[MAX];
+	struct source_type *locklist;	// 正在被持有的锁，删除时用最后一个填补空位
 	int lockidx; //
+	int lockcap;
+	struct hash_table lock_index;	// 锁地址 -> locklist 下标
+
+	int *mark;		// 检测环的 DFS 用，大小和顶点数组一致
+	int *stack;
+	int *child;
+	int stamp;
 
 	pthread_mutex_t mutex;
 };
 
 struct task_graph *tg = NULL;
-int path[MAX+1];
-int visited[MAX];
-int k = 0;
-int deadlock = 0;
+int deadlock = 0;		// 已经发现的环的个数
+
+
+static uint64 hash_key(uint64 key) {
 
-struct vertex *create_vertex(struct source_type type) {
+	// murmur3 的 fmix64，锁地址和线程 id 的低位都有规律，需要打散
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
 
-	struct vertex *tex = (struct vertex *)malloc(sizeof(struct vertex ));
+	return key;
+}
 
-	tex->s = type;
-	tex->next = NULL;
+void hash_init(struct hash_table *h, int size) {
 
-	return tex;
+	h->keys = (uint64 *)calloc(size, sizeof(uint64));
+	h->vals = (int *)malloc(size * sizeof(int));
+	h->size = size;
+	h->count = 0;
 
 }
 
+int hash_find(struct hash_table *h, uint64 key) {
 
-int search_vertex(struct source_type type) {
+	int mask = h->size - 1;
+	int i = hash_key(key) & mask;
+
+	while (h->keys[i] != 0) {
+
+		if (h->keys[i] == key) return h->vals[i];
+		i = (i + 1) & mask;
+
+	}
+
+	return -1;
+}
+
+static void hash_grow(struct hash_table *h);
+
+void hash_insert(struct hash_table *h, uint64 key, int val) {
+
+	int mask = h->size - 1;
+	int i = hash_key(key) & mask;
+
+	while (h->keys[i] != 0) {
+
+		if (h->keys[i] == key) {
+			h->vals[i] = val;
+			return ;
+		}
+		i = (i + 1) & mask;
+
+	}
+
+	h->keys[i] = key;
+	h->vals[i] = val;
+
+	if (++ h->count * 2 > h->size)
+		hash_grow(h);
+
+}
+
+static void hash_grow(struct hash_table *h) {
 
+	uint64 *keys = h->keys;
+	int *vals = h->vals;
+	int size = h->size;
 	int i = 0;
 
-	for (i = 0;i < tg->num;i ++) {
+	hash_init(h, size * 2);
+
+	for (i = 0;i < size;i ++) {
+		if (keys[i] != 0)
+			hash_insert(h, keys[i], vals[i]);
+	}
+
+	free(keys);
+	free(vals);
+
+}
+
+void hash_remove(struct hash_table *h, uint64 key) {
+
+	int mask = h->size - 1;
+	int i = hash_key(key) & mask;
+
+	while (h->keys[i] != key) {
+
+		if (h->keys[i] == 0) return ;
+		i = (i + 1) & mask;
+
+	}
+
+	// 后面同一条探测链上的元素前移，保证查找不会被空槽截断
+	int j = i;
+	while (1) {
+
+		j = (j + 1) & mask;
+		if (h->keys[j] == 0) break;
 
-		if (tg->list[i].s.type == type.type && tg->list[i].s.id == type.id) {
-			return i;
+		int home = hash_key(h->keys[j]) & mask;
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			h->keys[i] = h->keys[j];
+			h->vals[i] = h->vals[j];
+			i = j;
 		}
 
 	}
 
+	h->keys[i] = 0;
+	h->count --;
+
+}
+
+
+int search_vertex(struct source_type type) {
+
+	int idx = hash_find(&tg->vertex_index, type.id);
+
+	if (idx != -1 && tg->list[idx].s.type == type.type) {
+		return idx;
+	}
+
 	return -1;
 }
 
@@ -88,8 +241,24 @@ void add_vertex(struct source_type type) {
 
 	if (search_vertex(type) == -1) {
 
+		if (tg->num == tg->cap) {
+
+			tg->cap *= 2;
+			tg->list = (struct vertex *)realloc(tg->list, tg->cap * sizeof(struct vertex));
+			tg->mark = (int *)realloc(tg->mark, tg->cap * sizeof(int));
+			memset(tg->mark + tg->num, 0, (tg->cap - tg->num) * sizeof(int));
+			tg->stack = (int *)realloc(tg->stack, tg->cap * sizeof(int));
+			tg->child = (int *)realloc(tg->child, tg->cap * sizeof(int));
+
+		}
+
 		tg->list[tg->num].s = type;
-		tg->list[tg->num].next = NULL;
+		tg->list[tg->num].shared = 0;
+		tg->list[tg->num].nstack = 0;
+		tg->list[tg->num].held = NULL;
+		tg->list[tg->num].nheld = 0;
+		tg->list[tg->num].heldcap = 0;
+		hash_insert(&tg->vertex_index, type.id, tg->num);
 		tg->num ++;
 
 	}
@@ -97,376 +266,1532 @@ void add_vertex(struct source_type type) {
 }
 
 
-int add_edge(struct source_type from, struct source_type to) {
+// 线程退出后删除它的顶点，用最后一个顶点填补空位
+void remove_vertex(int idx) {
 
-	add_vertex(from);
-	add_vertex(to);
+	int last = -- tg->num;
 
-	struct vertex *v = &(tg->list[search_vertex(from)]);
+	free(tg->list[idx].held);
+	hash_remove(&tg->vertex_index, tg->list[idx].s.id);
 
-	while (v->next != NULL) {
-		v = v->next;
+	if (idx != last) {
+		tg->list[idx] = tg->list[last];
+		hash_insert(&tg->vertex_index, tg->list[idx].s.id, idx);
 	}
 
-	v->next = create_vertex(to);
+}
+
+
+#endif
+
+// 
+
+
+
+#if 1
+
+int search_lock(uint64 lock) {
+
+	return hash_find(&tg->lock_index, lock);
 
 }
 
+int add_lock(uint64_t tid, uint64 lock) {
 
-int verify_edge(struct source_type i, struct source_type j) {
+	if (tg->lockidx == tg->lockcap) {
 
-	if (tg->num == 0) return 0;
+		tg->lockcap *= 2;
+		tg->locklist = (struct source_type *)realloc(tg->locklist, tg->lockcap * sizeof(struct source_type));
 
-	int idx = search_vertex(i);
-	if (idx == -1) {
-		return 0;
 	}
 
-	struct vertex *v = &(tg->list[idx]);
+	int idx = tg->lockidx ++;
 
-	while (v != NULL) {
+	tg->locklist[idx].id = tid;
+	tg->locklist[idx].type = RESOURCE;
+	tg->locklist[idx].lock_id = lock;
+	tg->locklist[idx].degress = 0;
+	tg->locklist[idx].ts = 0;
+	tg->locklist[idx].readers = NULL;
+	tg->locklist[idx].nreaders = 0;
+	tg->locklist[idx].readercap = 0;
+	hash_insert(&tg->lock_index, lock, idx);
 
-		if (v->s.id == j.id) return 1;
+	return idx;
+}
 
-		v = v->next;
-		
-	}
+void remove_lock(int idx) {
 
-	return 0;
+	uint64 lock = tg->locklist[idx].lock_id;
+	int last = -- tg->lockidx;
+
+	free(tg->locklist[idx].readers);
+	hash_remove(&tg->lock_index, lock);
+
+	if (idx != last) {
+		tg->locklist[idx] = tg->locklist[last];
+		hash_insert(&tg->lock_index, tg->locklist[idx].lock_id, idx);
+	}
 
 }
 
 
-int remove_edge(struct source_type from, struct source_type to) {
+// 锁顺序模式(环境变量 DEADLOCK_LOCKORDER=1 打开):
+// 记录整个运行过程中 "持有 A 的同时去拿 B" 的边 A --> B，每条边只在第一次出现时记录调用点。
+// 新边 A --> B 加入时如果已经存在 B --> ... --> A 的路径，说明两处加锁顺序相反，
+// 只要交错得不巧就会死锁，不需要真的发生死锁就能报出来。
 
-	int idxi = search_vertex(from);
-	int idxj = search_vertex(to);
+struct order_edge {
 
-	if (idxi != -1 && idxj != -1) {
+	int to;
+	uint64 held_ip;		// 拿 A 的调用点
+	uint64 acquire_ip;	// 持有 A 时拿 B 的调用点
+	uint64 tid;
+	int shared;		// B 是以读锁方式拿的
 
-		struct vertex *v = &tg->list[idxi];
-		struct vertex *remove;
+};
 
-		while (v->next != NULL) {
+struct order_node {
 
-			if (v->next->s.id == to.id) {
+	uint64 lock;
+	struct order_edge *edges;
+	int num;
+	int cap;
 
-				remove = v->next;
-				v->next = v->next->next;
+};
 
-				free(remove);
-				break;
+struct order_graph {
 
-			}
+	struct order_node *nodes;	// 节点只增不删，锁销毁后地址被复用时建新节点
+	int num;
+	int cap;
+	struct hash_table index;	// 锁地址 -> nodes 下标
 
-			v = v->next;
-		}
+	int *mark;		// BFS 用，mark[i] == stamp 表示本轮已访问
+	int *prev;		// BFS 路径: 到达 i 的前驱节点和经过的边
+	int *prev_edge;
+	int *queue;
+	int stamp;
 
-	}
+};
 
-}
+int lockorder = 0;
+int inversions = 0;	// 已经发现的顺序反转个数
+struct order_graph *og = NULL;
 
 
-void print_deadlock(void) {
+void order_init(void) {
 
-	int i = 0;
+	og = (struct order_graph *)calloc(1, sizeof(struct order_graph));
+	og->cap = HASH_INIT_SIZE;
+	og->nodes = (struct order_node *)malloc(og->cap * sizeof(struct order_node));
+	og->mark = (int *)calloc(og->cap, sizeof(int));
+	og->prev = (int *)malloc(og->cap * sizeof(int));
+	og->prev_edge = (int *)malloc(og->cap * sizeof(int));
+	og->queue = (int *)malloc(og->cap * sizeof(int));
+	hash_init(&og->index, HASH_INIT_SIZE);
+
+}
 
-	printf("cycle : ");
-	for (i = 0;i < k-1;i ++) {
+int order_node(uint64 lock) {
 
-		printf("%ld --> ", tg->list[path[i]].s.id);
+	int idx = hash_find(&og->index, lock);
+	if (idx != -1) return idx;
+
+	if (og->num == og->cap) {
+
+		og->cap *= 2;
+		og->nodes = (struct order_node *)realloc(og->nodes, og->cap * sizeof(struct order_node));
+		og->mark = (int *)realloc(og->mark, og->cap * sizeof(int));
+		memset(og->mark + og->num, 0, (og->cap - og->num) * sizeof(int));
+		og->prev = (int *)realloc(og->prev, og->cap * sizeof(int));
+		og->prev_edge = (int *)realloc(og->prev_edge, og->cap * sizeof(int));
+		og->queue = (int *)realloc(og->queue, og->cap * sizeof(int));
 
 	}
 
-	printf("%ld\n", tg->list[path[i]].s.id);
+	idx = og->num ++;
+	og->nodes[idx].lock = lock;
+	og->nodes[idx].edges = NULL;
+	og->nodes[idx].num = 0;
+	og->nodes[idx].cap = 0;
+	hash_insert(&og->index, lock, idx);
 
+	return idx;
 }
 
-int DFS(int idx) {
+// 锁被销毁: 地址之后可能分配给别的锁，断开映射并丢掉它的出边
+void order_forget(uint64 lock) {
 
-	struct vertex *ver = &tg->list[idx];
-	if (visited[idx] == 1) {
+	int idx = hash_find(&og->index, lock);
+	if (idx == -1) return ;
 
-		path[k++] = idx;
-		print_deadlock();
-		deadlock = 1;
-		
-		return 0;
-	}
+	hash_remove(&og->index, lock);
+	free(og->nodes[idx].edges);
+	og->nodes[idx].edges = NULL;
+	og->nodes[idx].num = 0;
+	og->nodes[idx].cap = 0;
 
-	visited[idx] = 1;
-	path[k++] = idx;
+}
 
-	while (ver->next != NULL) {
+void print_site(uint64 ip) {
 
-		DFS(search_vertex(ver->next->s));
-		k --;
-		
-		ver = ver->next;
+	Dl_info info;
 
+	// 可执行文件里的静态函数没有符号时打印 模块+偏移，可以直接交给 addr2line
+	if (ip && dladdr((void *)ip, &info)) {
+		if (info.dli_sname)
+			printf("%s+%#lx", info.dli_sname, ip - (uint64)info.dli_saddr);
+		else
+			printf("%s+%#lx", info.dli_fname, ip - (uint64)info.dli_fbase);
+	} else {
+		printf("%#lx", ip);
 	}
 
-	
-	return 1;
-
 }
 
+void print_order_edge(int from, struct order_edge *e) {
 
-int search_for_cycle(int idx) {
+	printf("    %#lx --> %#lx  thread %lu: held at ", og->nodes[from].lock, og->nodes[e->to].lock, e->tid);
+	print_site(e->held_ip);
+	printf(", acquired at ");
+	print_site(e->acquire_ip);
+	printf("\n");
 
-	
+}
+
+// 从 from 出发 BFS 找 to，找到时 prev/prev_edge 记录了路径
+int order_reachable(int from, int to) {
 
-	struct vertex *ver = &tg->list[idx];
-	visited[idx] = 1;
-	k = 0;
-	path[k++] = idx;
+	int head = 0, tail = 0;
 
-	while (ver->next != NULL) {
+	og->stamp ++;
+	og->mark[from] = og->stamp;
+	og->queue[tail ++] = from;
 
+	while (head < tail) {
+
+		int cur = og->queue[head ++];
 		int i = 0;
-		for (i = 0;i < tg->num;i ++) {
-			if (i == idx) continue;
-			
-			visited[i] = 0;
-		}
 
-		for (i = 1;i <= MAX;i ++) {
-			path[i] = -1;
+		for (i = 0;i < og->nodes[cur].num;i ++) {
+
+			int next = og->nodes[cur].edges[i].to;
+			if (og->mark[next] == og->stamp) continue;
+
+			og->mark[next] = og->stamp;
+			og->prev[next] = cur;
+			og->prev_edge[next] = i;
+			if (next == to) return 1;
+
+			og->queue[tail ++] = next;
+
 		}
-		k = 1;
 
-		DFS(search_vertex(ver->next->s));
-		ver = ver->next;
 	}
 
+	return 0;
 }
 
+void print_inversion(int a, int b, struct order_edge *e) {
 
+	int path[64];
+	int n = 0, cur = a;
 
+	printf("lock order inversion:\n");
+	print_order_edge(a, e);
+	printf("  conflicts with earlier order:\n");
 
-#endif
+	// 路径是倒着记录的，先收集再正序打印，太长只打印最后 64 条
+	while (cur != b && n < 64) {
+		path[n ++] = cur;
+		cur = og->prev[cur];
+	}
+	while (n -- > 0) {
+		int to = path[n];
+		int from = og->prev[to];
+		print_order_edge(from, &og->nodes[from].edges[og->prev_edge[to]]);
+	}
 
-// 
+}
 
+// 找到的路径 b --> ... --> a 上是不是全是读锁边
+static int order_path_shared(int a, int b) {
 
+	int cur = a;
 
-#if 1
+	while (cur != b) {
+		int from = og->prev[cur];
+		if (!og->nodes[from].edges[og->prev_edge[cur]].shared) return 0;
+		cur = from;
+	}
 
-int search_lock(uint64 lock) {
+	return 1;
+}
+
+// 线程持有 held 的同时拿到了 lock
+void order_add_edge(uint64 tid, struct held_lock *held, uint64 lock, uint64 ip, int shared) {
 
+	int a = order_node(held->lock);
+	int b = order_node(lock);
 	int i = 0;
-	
-	for (i = 0;i < tg->lockidx;i ++) {
-		
-		if (tg->locklist[i].lock_id == lock) {
-			return i;
-		}
+
+	if (a == b) return ;
+
+	for (i = 0;i < og->nodes[a].num;i ++) {
+		if (og->nodes[a].edges[i].to == b) return ;
+	}
+
+	struct order_node *node = &og->nodes[a];
+	if (node->num == node->cap) {
+		node->cap = node->cap ? node->cap * 2 : 4;
+		node->edges = (struct order_edge *)realloc(node->edges, node->cap * sizeof(struct order_edge));
+	}
+
+	struct order_edge *e = &node->edges[node->num ++];
+	e->to = b;
+	e->held_ip = held->ip;
+	e->acquire_ip = ip;
+	e->tid = tid;
+	e->shared = shared;
+
+	// 只由读锁组成的环不会死锁(读锁之间不互斥)，不报
+	if (order_reachable(b, a) && !(shared && order_path_shared(a, b))) {
+		inversions ++;
+		print_inversion(a, b, e);
 	}
 
-	return -1;
 }
 
-int search_empty_lock(uint64 lock) {
+// trylock 拿锁不会阻塞，不产生顺序边，但之后持有期间再拿别的锁要记边
+void order_acquire(int self, uint64 lock, uint64 ip, uint64 ts, int flags) {
 
+	struct vertex *v = &tg->list[self];
 	int i = 0;
-	
-	for (i = 0;i < tg->lockidx;i ++) {
-		
-		if (tg->locklist[i].lock_id == 0) {
-			return i;
-		}
+
+	for (i = 0;lockorder && i < v->nheld && !(flags & EVENT_TRY);i ++) {
+		order_add_edge(v->s.id, &v->held[i], lock, ip, flags & EVENT_SHARED);
+	}
+
+	if (v->nheld == v->heldcap) {
+		v->heldcap = v->heldcap ? v->heldcap * 2 : 8;
+		v->held = (struct held_lock *)realloc(v->held, v->heldcap * sizeof(struct held_lock));
 	}
 
-	return tg->lockidx;
+	v->held[v->nheld].lock = lock;
+	v->held[v->nheld].ip = ip;
+	v->held[v->nheld].ts = ts;
+	v->nheld ++;
 
 }
 
+// 返回获得这把锁的时间，没找到返回 0
+uint64 order_release(int self, uint64 lock) {
 
+	struct vertex *v = &tg->list[self];
+	uint64 ts = 0;
+	int i = 0;
 
-void lock_before(uint64_t tid, uint64_t lockaddr) {
-	/*
-	1. 	if (lockaddr) {
-			tid --> lockaddr.tid;
-	   	}
-	*/
+	// 一般是后拿先放，从栈顶往下找
+	for (i = v->nheld - 1;i >= 0;i --) {
+		if (v->held[i].lock == lock) {
+			ts = v->held[i].ts;
+			memmove(&v->held[i], &v->held[i + 1], (v->nheld - i - 1) * sizeof(struct held_lock));
+			v->nheld --;
+			break;
+		}
+	}
 
-	int idx = 0;
+	return ts;
+}
 
-	for (idx = 0;idx < tg->lockidx;idx ++) {
 
-		if (tg->locklist[idx].lock_id == lockaddr) { // 
+// 锁竞争分析模式(环境变量 DEADLOCK_PROFILE=N 打开，每 N 秒输出一次，0 表示只在收到 SIGUSR2 时输出):
+// 每个线程的事件环就是线程私有的缓冲，统计全部在 thread_routine 里做，hook 上不多加任何共享写。
+//   等待时间 = LOCK_BEFORE 到 LOCK_AFTER，没有竞争的加锁算 0；
+//   持有时间 = 同一个线程 LOCK_AFTER 到 UNLOCK_AFTER，借用锁顺序模式的 held 记录获得时间；
+//   只有需要等待时才取调用栈，按 锁 + 调用栈 汇总等待次数和时间。
 
-			struct source_type from;
-			from.id = tid;
-			from.type = PROCESS;
-			add_vertex(from);
+#define PROFILE_BUCKETS		40	// 直方图按 2 的幂分桶(ns)
+#define PROFILE_TOP_LOCKS	20
+#define PROFILE_TOP_STACKS	5
 
-			struct source_type to;
-			to.id = tg->locklist[idx].id;
-			to.type = PROCESS;
-			add_vertex(to);
+struct lock_stat {
 
-			
-			tg->locklist[idx].degress ++;
+	uint64 lock;
+	uint64 acquired;	// 获得锁的次数
+	uint64 contended;	// 需要等待的次数
+	uint64 wait_total;	// ns
+	uint64 wait_max;
+	uint64 released;	// 统计了持有时间的次数
+	uint64 hold_total;
+	uint64 hold_max;
+	uint64 wait_hist[PROFILE_BUCKETS];
+	uint64 hold_hist[PROFILE_BUCKETS];
 
-			if (!verify_edge(from, to))
-				add_edge(from, to);
+};
 
-		}
+struct stack_stat {
 
-	}
-	
-	
-}
+	uint64 lock;
+	uint64 frames[PROFILE_DEPTH];
+	int depth;
+	uint64 count;
+	uint64 wait_total;	// ns
 
-void lock_after(uint64_t tid, uint64_t lockaddr) {
+};
 
-	/*
-		if (!lockaddr) {
+struct lock_profile {
 
-			tid --> lockaddr;
+	struct lock_stat *locks;
+	int nlocks;
+	int lockcap;
+	struct hash_table lock_index;	// 锁地址 -> locks 下标
 
-		} else {
+	struct stack_stat *stacks;
+	int nstacks;
+	int stackcap;
+	struct hash_table stack_index;	// hash(锁, 调用栈) -> stacks 下标
 
-			lockaddr.tid = tid;
-			tid -> lockaddr;
+	double ns_per_tick;	// event_clock 的单位换算成 ns
+	int interval;		// 输出间隔(s)
 
-		}
-		
-	 */
-	int idx = 0;
-	if (-1 == (idx = search_lock(lockaddr))) {// 
+};
 
-		int eidx = search_empty_lock(lockaddr);
+int profile = 0;
+struct lock_profile *lp = NULL;
+static volatile sig_atomic_t profile_dump_request = 0;
 
-		tg->locklist[eidx].id = tid;
-		tg->locklist[eidx].lock_id = lockaddr;
 
-		tg->lockidx ++;
-		
-	} else {
+void profile_init(int interval) {
 
-		struct source_type from;
-		from.id = tid;
-		from.type = PROCESS;
-		add_vertex(from);
+	lp = (struct lock_profile *)calloc(1, sizeof(struct lock_profile));
+	lp->lockcap = HASH_INIT_SIZE;
+	lp->locks = (struct lock_stat *)malloc(lp->lockcap * sizeof(struct lock_stat));
+	hash_init(&lp->lock_index, HASH_INIT_SIZE);
+	lp->stackcap = HASH_INIT_SIZE;
+	lp->stacks = (struct stack_stat *)malloc(lp->stackcap * sizeof(struct stack_stat));
+	hash_init(&lp->stack_index, HASH_INIT_SIZE);
+	lp->ns_per_tick = 1.0;
+	lp->interval = interval;
 
-		struct source_type to;
-		to.id = tg->locklist[idx].id;
-		to.type = PROCESS;
-		add_vertex(to);
+}
 
-		
-		tg->locklist[idx].degress --;
+static int profile_bucket(uint64 ns) {
 
-		if (verify_edge(from, to))
-			remove_edge(from, to);
+	int b = ns ? 64 - __builtin_clzl(ns) : 0;
 
-		tg->locklist[idx].id = tid;
-		
-	}
-	 
-	
+	return b < PROFILE_BUCKETS ? b : PROFILE_BUCKETS - 1;
 }
 
+struct lock_stat *profile_lock(uint64 lock) {
 
-void unlock_after(uint64_t tid, uint64_t lockaddr) {
+	int idx = hash_find(&lp->lock_index, lock);
+	if (idx != -1) return &lp->locks[idx];
 
-	// lockaddr.tid = 0;
+	if (lp->nlocks == lp->lockcap) {
+		lp->lockcap *= 2;
+		lp->locks = (struct lock_stat *)realloc(lp->locks, lp->lockcap * sizeof(struct lock_stat));
+	}
 
-	int idx = search_lock(lockaddr);
+	idx = lp->nlocks ++;
+	memset(&lp->locks[idx], 0, sizeof(struct lock_stat));
+	lp->locks[idx].lock = lock;
+	hash_insert(&lp->lock_index, lock, idx);
 
-	if (tg->locklist[idx].degress == 0) {
-		tg->locklist[idx].id = 0;
-		tg->locklist[idx].lock_id = 0;
-	}
-	
+	return &lp->locks[idx];
 }
 
+static void profile_stack(uint64 lock, uint64 *frames, int depth, uint64 wait) {
 
-void check_dead_lock(void) {
-
+	uint64 key = hash_key(lock);
 	int i = 0;
 
-	deadlock = 0;
-	for (i = 0;i < tg->num;i ++) {
-		if (deadlock == 1) break;
-		search_for_cycle(i);
+	for (i = 0;i < depth;i ++) {
+		key = hash_key(key ^ frames[i]);
 	}
+	if (key == 0) key = 1;
+
+	int idx = hash_find(&lp->stack_index, key);
+	if (idx == -1) {
+
+		if (lp->nstacks == lp->stackcap) {
+			lp->stackcap *= 2;
+			lp->stacks = (struct stack_stat *)realloc(lp->stacks, lp->stackcap * sizeof(struct stack_stat));
+		}
+
+		idx = lp->nstacks ++;
+		lp->stacks[idx].lock = lock;
+		memcpy(lp->stacks[idx].frames, frames, depth * sizeof(uint64));
+		lp->stacks[idx].depth = depth;
+		lp->stacks[idx].count = 0;
+		lp->stacks[idx].wait_total = 0;
+		hash_insert(&lp->stack_index, key, idx);
 
-	if (deadlock == 0) {
-		printf("no deadlock\n");
 	}
 
+	lp->stacks[idx].count ++;
+	lp->stacks[idx].wait_total += wait;
+
 }
 
+// self 拿到了 lock，waited 表示之前在等这把锁，等待从 start 开始
+void profile_acquire(int self, uint64 lock, uint64 start, uint64 ts, int waited) {
 
-static void *thread_routine(void *args) {
+	struct lock_stat *st = profile_lock(lock);
+	uint64 wait = 0;
 
-	while (1) {
+	st->acquired ++;
+
+	if (waited) {
+
+		wait = ts > start ? (uint64)((ts - start) * lp->ns_per_tick) : 0;
+
+		st->contended ++;
+		st->wait_total += wait;
+		if (wait > st->wait_max) st->wait_max = wait;
 
-		sleep(5);
-		check_dead_lock();
+		if (tg->list[self].nstack > 0)
+			profile_stack(lock, tg->list[self].stack, tg->list[self].nstack, wait);
 
 	}
 
+	st->wait_hist[profile_bucket(wait)] ++;
+
 }
 
+void profile_release(uint64 lock, uint64 start, uint64 ts) {
 
-void start_check(void) {
+	struct lock_stat *st = profile_lock(lock);
+	uint64 hold = ts > start ? (uint64)((ts - start) * lp->ns_per_tick) : 0;
 
-	tg = (struct task_graph*)malloc(sizeof(struct task_graph));
-	tg->num = 0;
-	tg->lockidx = 0;
-	
-	pthread_t tid;
+	st->released ++;
+	st->hold_total += hold;
+	if (hold > st->hold_max) st->hold_max = hold;
+	st->hold_hist[profile_bucket(hold)] ++;
 
-	pthread_create(&tid, NULL, thread_routine, NULL);
+}
+
+static void print_ns(uint64 ns) {
+
+	if (ns < 1000)
+		printf("%luns", ns);
+	else if (ns < 1000000)
+		printf("%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		printf("%.1fms", ns / 1e6);
+	else
+		printf("%.2fs", ns / 1e9);
 
 }
 
+static void print_hist(const char *name, uint64 *hist) {
 
-// hook
-// define
-typedef int (*pthread_mutex_lock_t)(pthread_mutex_t *mutex);
-pthread_mutex_lock_t pthread_mutex_lock_f = NULL;
+	int i = 0;
 
-typedef int (*pthread_mutex_unlock_t)(pthread_mutex_t *mutex);
-pthread_mutex_unlock_t pthread_mutex_unlock_f = NULL;
+	printf("    %s:", name);
+	for (i = 0;i < PROFILE_BUCKETS;i ++) {
+		if (hist[i] == 0) continue;
+		if (i == 0) {
+			printf(" 0 %lu", hist[i]);
+			continue;
+		}
+		printf(" <");
+		print_ns(1UL << i);
+		printf(" %lu", hist[i]);
+	}
+	printf("\n");
 
+}
 
-// implement
-int pthread_mutex_lock(pthread_mutex_t *mutex) {
+static int lock_stat_cmp(const void *a, const void *b) {
 
-	
-	pthread_t selfid = pthread_self();
-	
-	lock_before((uint64_t)selfid, (uint64_t)mutex);
-	
-	pthread_mutex_lock_f(mutex);
+	const struct lock_stat *x = *(const struct lock_stat **)a;
+	const struct lock_stat *y = *(const struct lock_stat **)b;
 
-	lock_after((uint64_t)selfid, (uint64_t)mutex);
+	if (x->wait_total != y->wait_total)
+		return x->wait_total < y->wait_total ? 1 : -1;
 
-	
+	return x->acquired < y->acquired ? 1 : (x->acquired > y->acquired ? -1 : 0);
 }
 
-int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+static int stack_stat_cmp(const void *a, const void *b) {
 
-	pthread_mutex_unlock_f(mutex);
+	const struct stack_stat *x = *(const struct stack_stat **)a;
+	const struct stack_stat *y = *(const struct stack_stat **)b;
 
-	pthread_t selfid = pthread_self();
-	unlock_after((uint64_t)selfid, (uint64_t)mutex);
-	
+	return x->wait_total < y->wait_total ? 1 : (x->wait_total > y->wait_total ? -1 : 0);
 }
 
-// init
-void init_hook(void) {
+// 按总等待时间排序，输出前 PROFILE_TOP_LOCKS 把锁和各自等待最久的调用栈
+void profile_dump(void) {
 
-	if (!pthread_mutex_lock_f)
-		pthread_mutex_lock_f = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+	struct lock_stat **locks = (struct lock_stat **)malloc((lp->nlocks + 1) * sizeof(struct lock_stat *));
+	struct stack_stat **stacks = (struct stack_stat **)malloc((lp->nstacks + 1) * sizeof(struct stack_stat *));
+	int i = 0, j = 0, n = 0;
 
-	if (!pthread_mutex_unlock_f)
-		pthread_mutex_unlock_f = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+	for (i = 0;i < lp->nlocks;i ++) {
+		locks[i] = &lp->locks[i];
+	}
+	qsort(locks, lp->nlocks, sizeof(struct lock_stat *), lock_stat_cmp);
+
+	printf("==== lock profile: %d locks ====\n", lp->nlocks);
+
+	for (i = 0;i < lp->nlocks && i < PROFILE_TOP_LOCKS;i ++) {
+
+		struct lock_stat *st = locks[i];
+
+		printf("lock %#lx  acquired %lu  contended %lu (%.1f%%)  wait total ", st->lock, st->acquired,
+			st->contended, st->acquired ? 100.0 * st->contended / st->acquired : 0.0);
+		print_ns(st->wait_total);
+		printf(" max ");
+		print_ns(st->wait_max);
+		printf("  hold avg ");
+		print_ns(st->released ? st->hold_total / st->released : 0);
+		printf(" max ");
+		print_ns(st->hold_max);
+		printf("\n");
+
+		print_hist("wait", st->wait_hist);
+		if (st->released)
+			print_hist("hold", st->hold_hist);
+
+		for (j = 0, n = 0;j < lp->nstacks;j ++) {
+			if (lp->stacks[j].lock == st->lock)
+				stacks[n ++] = &lp->stacks[j];
+		}
+		qsort(stacks, n, sizeof(struct stack_stat *), stack_stat_cmp);
+
+		for (j = 0;j < n && j < PROFILE_TOP_STACKS;j ++) {
+
+			int k = 0;
+
+			printf("    contended %lu times, wait ", stacks[j]->count);
+			print_ns(stacks[j]->wait_total);
+			printf("\n");
+			for (k = 0;k < stacks[j]->depth;k ++) {
+				printf("        ");
+				print_site(stacks[j]->frames[k]);
+				printf("\n");
+			}
+
+		}
+
+	}
+
+	fflush(stdout);
+	free(locks);
+	free(stacks);
+
+}
+
+
+
+// 下面三个函数只在 thread_routine 中调用，图只有这一个线程读写，不需要加锁。
+// 各线程的事件环是分开取的，不同线程之间的事件可能乱序到达:
+//   线程记录自己在等哪把锁(s.lock_id)，同一线程的事件是有序的；
+//   锁记录持有者和获得锁的时间，时间更早的 lock_after 不会覆盖新的持有者，
+//   unlock 只有持有者本人才能删除锁记录。
+// 等待边 tid --> 持有者 由这些状态隐式表示，不单独存边。
+
+int thread_vertex(uint64_t tid) {
+
+	struct source_type self;
+	self.id = tid;
+	self.type = PROCESS;
+	self.lock_id = 0;
+	self.degress = 0;
+	self.ts = 0;
+	self.readers = NULL;
+	self.nreaders = 0;
+	self.readercap = 0;
+	add_vertex(self);
+
+	return search_vertex(self);
+}
+
+// cur 等待的锁的第 i 个持有者的顶点下标: i == 0 是写锁持有者，之后是各个读者；
+// 等读锁的线程只被写锁持有者阻塞。没有更多返回 -2，跳过这一个(空闲/自己/没有顶点)返回 -1
+static int wait_for(int cur, int i) {
+
+	uint64 lock = tg->list[cur].s.lock_id;
+	if (lock == 0) return -2;
+
+	int idx = search_lock(lock);
+	if (idx == -1) return -2;
+
+	struct source_type *l = &tg->locklist[idx];
+	struct source_type holder;
+
+	if (i == 0) {
+		holder.id = l->id;
+	} else if (!tg->list[cur].shared && i <= l->nreaders) {
+		holder.id = l->readers[i - 1];
+	} else {
+		return -2;
+	}
+
+	if (holder.id == 0 || holder.id == tg->list[cur].s.id) return -1;
+
+	holder.type = PROCESS;
+	return search_vertex(holder);
+}
+
+// DFS 栈上的 n 个顶点就是环
+void print_deadlock(int n) {
+
+	int i = 0;
+
+	printf("deadlock : ");
+	for (i = 0;i < n;i ++) {
+
+		int cur = tg->stack[i];
+		printf("%lu (wait %#lx%s) --> ", tg->list[cur].s.id, tg->list[cur].s.lock_id,
+			tg->list[cur].shared ? " shared" : "");
+
+	}
+
+	printf("%lu\n", tg->list[tg->stack[0]].s.id);
+
+}
+
+// 新增了从 self 出发的等待边之后调用: 从 self 沿着 等待的锁 --> 持有者 做 DFS，回到 self 说明刚刚成环。
+// 互斥锁出度为 1 时就是沿着链走一遍；等写锁时会分叉到所有读者，代价是能到达的子图大小。
+// 环只在闭合的那一刻被发现一次，不会重复打印。
+int check_cycle(int self) {
+
+	int top = 0;
+
+	tg->stamp ++;
+	tg->mark[self] = tg->stamp;
+	tg->stack[0] = self;
+	tg->child[0] = 0;
+
+	while (top >= 0) {
+
+		int cur = tg->stack[top];
+		int next = wait_for(cur, tg->child[top] ++);
+
+		if (next == -2) {
+			top --;
+			continue;
+		}
+		if (next == -1) continue;
+
+		if (next == self) {
+			deadlock ++;
+			print_deadlock(top + 1);
+			return 1;
+		}
+
+		// 已经走过的顶点不会再到 self(否则第一次就找到了)
+		if (tg->mark[next] == tg->stamp) continue;
+
+		tg->mark[next] = tg->stamp;
+		top ++;
+		tg->stack[top] = next;
+		tg->child[top] = 0;
+
+	}
+
+	return 0;
+}
+
+void lock_before(uint64_t tid, uint64_t lockaddr, uint64_t ts, int flags) {
+	/*
+	1. 	if (lockaddr) {
+			tid --> lockaddr.tid;
+	   	}
+	*/
+
+	int self = thread_vertex(tid);
+
+	tg->list[self].s.lock_id = lockaddr;
+	tg->list[self].s.ts = ts;
+	tg->list[self].shared = (flags & EVENT_SHARED) != 0;
+	tg->list[self].nstack = 0;
+
+	int idx = search_lock(lockaddr);
+	if (idx != -1) {
+		tg->locklist[idx].degress ++;
+		check_cycle(self);
+	}
+
+}
+
+// timedlock 超时，不再等待
+void lock_cancel(uint64_t tid) {
+
+	int self = thread_vertex(tid);
+
+	tg->list[self].s.lock_id = 0;
+
+}
+
+void lock_after(uint64_t tid, uint64_t lockaddr, uint64_t ts, uint64_t ip, int flags) {
+
+	/*
+		if (!lockaddr) {
+
+			tid --> lockaddr;
+
+		} else {
+
+			lockaddr.tid = tid;
+			tid -> lockaddr;
+
+		}
+		
+	 */
+	int self = thread_vertex(tid);
+
+	if (profile)
+		profile_acquire(self, lockaddr, tg->list[self].s.ts, ts, tg->list[self].s.lock_id == lockaddr);
+
+	tg->list[self].s.lock_id = 0;
+	tg->list[self].s.ts = ts;
+
+	if (lockorder || profile)
+		order_acquire(self, lockaddr, ip, ts, flags);
+
+	int idx = search_lock(lockaddr);
+
+	if (flags & EVENT_SHARED) {
+
+		// 读锁: 加入读者，不影响写锁持有者
+		if (idx == -1) {
+			idx = add_lock(0, lockaddr);
+		}
+
+		struct source_type *l = &tg->locklist[idx];
+		if (l->nreaders == l->readercap) {
+			l->readercap = l->readercap ? l->readercap * 2 : 4;
+			l->readers = (uint64 *)realloc(l->readers, l->readercap * sizeof(uint64));
+		}
+		l->readers[l->nreaders ++] = tid;
+
+	} else if (idx == -1) {// 
+
+		idx = add_lock(tid, lockaddr);
+		tg->locklist[idx].ts = ts;
+		
+	} else if (tg->locklist[idx].ts <= ts) {
+
+		if (tg->locklist[idx].degress > 0)
+			tg->locklist[idx].degress --;
+
+		tg->locklist[idx].id = tid;
+		tg->locklist[idx].ts = ts;
+		
+	}
+	 
+	
+}
+
+
+void unlock_after(uint64_t tid, uint64_t lockaddr, uint64_t ts) {
+
+	// lockaddr.tid = 0;
+
+	if (lockorder || profile) {
+		uint64 start = order_release(thread_vertex(tid), lockaddr);
+		if (profile && start)
+			profile_release(lockaddr, start, ts);
+	}
+
+	int idx = search_lock(lockaddr);
+	if (idx == -1) return ;
+
+	struct source_type *l = &tg->locklist[idx];
+	int i = 0;
+
+	// 读写锁的 unlock 不区分模式: 持有写锁就是放写锁，否则放掉一个读锁
+	if (l->id == tid) {
+		l->id = 0;
+	} else {
+		for (i = l->nreaders - 1;i >= 0;i --) {
+			if (l->readers[i] == tid) {
+				l->readers[i] = l->readers[-- l->nreaders];
+				break;
+			}
+		}
+	}
+
+	if (l->id == 0 && l->nreaders == 0) {
+		remove_lock(idx);
+	}
+	
+}
+
+
+// 每个线程一个单生产者单消费者的事件环:
+// hook 只往自己的环里追加 {时间, 锁, 类型}，不碰图，也不和其他线程竞争；
+// thread_routine 定期把所有环取空，在后台维护图。
+
+#define EVENT_RING_SIZE		1024	// 每个线程的事件环大小，必须是 2 的幂
+#define DRAIN_INTERVAL		100	// thread_routine 取事件的间隔(ms)，也是发现死锁的最大延迟；环过半和 dump 请求由 eventfd 提前唤醒
+
+
+struct lock_event {
+
+	uint64 ts;
+	uint64 lock;
+	uint64 ip;	// hook 的返回地址，也就是加锁的调用点
+	uint64 type;
+
+};
+
+struct event_ring {
+
+	struct lock_event events[EVENT_RING_SIZE];
+
+	uint64 head __attribute__((aligned(64)));	// 生产者写
+	uint64 tail_cache;	// 生产者看到的 tail，满了才重新读
+
+	uint64 tail __attribute__((aligned(64)));	// thread_routine 写
+
+	uint64 tid;
+	int dead;	// 线程已经退出，取空之后由 thread_routine 释放
+	struct event_ring *next;
+
+};
+
+struct event_ring *rings = NULL;	// 所有线程的事件环，新的插在表头
+static pthread_key_t ring_key;
+static __thread struct event_ring *local_ring = NULL;
+static __thread int in_detector = 0;	// thread_routine 自己加锁不记录
+static int wake_fd = -1;	// 事件环过半时唤醒 thread_routine
+
+
+static inline uint64 event_clock(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+
+}
+
+static void profile_signal(int sig) {
+
+	uint64 one = 1;
+
+	profile_dump_request = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0) {}
+
+}
+
+// event_clock 在 x86 上是 TSC，用一小段时间校准成 ns
+static void profile_calibrate(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec t0, t1;
+	uint64 c0, c1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = event_clock();
+	usleep(20000);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = event_clock();
+
+	lp->ns_per_tick = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / (double)(c1 - c0);
+#endif
+
+}
+
+static void ring_release(void *arg) {
+
+	struct event_ring *ring = (struct event_ring *)arg;
+
+	local_ring = NULL;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+
+}
+
+static struct event_ring *ring_create(void) {
+
+	struct event_ring *ring = NULL;
+
+	if (posix_memalign((void **)&ring, 64, sizeof(struct event_ring)))
+		return NULL;
+
+	memset(ring, 0, sizeof(struct event_ring));
+	ring->tid = (uint64)pthread_self();
+
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	pthread_setspecific(ring_key, ring);
+	local_ring = ring;
+
+	return ring;
+}
+
+// ts 只有 LOCK_AFTER 必须带(判断持有者的新旧)，unlock 传 0 省掉一次读时钟；
+// 性能分析模式下 unlock 也要带，用来算持有时间
+#define UNLOCK_CLOCK()	(profile ? event_clock() : 0)
+
+static inline void record_event(int type, void *lock, uint64 ts, void *ip) {
+
+	if (tg == NULL || in_detector) return ;
+
+	struct event_ring *ring = local_ring;
+	if (ring == NULL && (ring = ring_create()) == NULL) return ;
+
+	uint64 head = ring->head;
+
+	if (head - ring->tail_cache == EVENT_RING_SIZE / 2) {
+		// 每半个环最多一次系统调用，均摊到每个事件上可以忽略
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - ring->tail_cache >= EVENT_RING_SIZE / 2) {
+			uint64 one = 1;
+			if (write(wake_fd, &one, sizeof(one)) < 0) {}
+		}
+	} else if (head - ring->tail_cache == EVENT_RING_SIZE) {
+		// 满了等 thread_routine 取走，正常情况下不会走到这里
+		while (head - (ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == EVENT_RING_SIZE)
+			sched_yield();
+	}
+
+	struct lock_event *ev = &ring->events[head & (EVENT_RING_SIZE - 1)];
+	ev->ts = ts;
+	ev->lock = (uint64)lock;
+	ev->ip = (uint64)ip;
+	ev->type = type;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+}
+
+// 要等锁时调用(已经有竞争，不在快路径上): 记录 LOCK_BEFORE，
+// 性能分析模式下把调用栈跟在后面，跳过 record_wait 和 hook 自己两帧
+static __attribute__((noinline)) void record_wait(int type, void *lock, void *ip) {
+
+	record_event(type, lock, event_clock(), ip);
+
+	if (profile && tg != NULL && !in_detector) {
+
+		void *frames[PROFILE_DEPTH + 2];
+		int n = backtrace(frames, PROFILE_DEPTH + 2);
+		int i = 0;
+
+		for (i = 2;i < n;i += 3) {
+			record_event(STACK_FRAMES, frames[i], (uint64)(i + 1 < n ? frames[i + 1] : NULL),
+				i + 2 < n ? frames[i + 2] : NULL);
+		}
+
+	}
+
+}
+
+// 跟在 LOCK_BEFORE 后面的调用栈，每个事件带 3 帧，依次放在 lock, ts, ip 里
+static void stack_frames(uint64 tid, struct lock_event *ev) {
+
+	struct vertex *v = &tg->list[thread_vertex(tid)];
+	uint64 frames[3] = {ev->lock, ev->ts, ev->ip};
+	int i = 0;
+
+	for (i = 0;i < 3 && frames[i] && v->nstack < PROFILE_DEPTH;i ++) {
+		v->stack[v->nstack ++] = frames[i];
+	}
+
+}
+
+static void apply_event(uint64 tid, struct lock_event *ev) {
+
+	int flags = ev->type & ~EVENT_TYPE_MASK;
+
+	switch (ev->type & EVENT_TYPE_MASK) {
+		case LOCK_BEFORE:
+			lock_before(tid, ev->lock, ev->ts, flags);
+			break;
+		case LOCK_AFTER:
+			lock_after(tid, ev->lock, ev->ts, ev->ip, flags);
+			break;
+		case UNLOCK_AFTER:
+			unlock_after(tid, ev->lock, ev->ts);
+			break;
+		case LOCK_CANCEL:
+			lock_cancel(tid);
+			break;
+		case LOCK_DESTROY:
+			if (lockorder)
+				order_forget(ev->lock);
+			break;
+		case STACK_FRAMES:
+			stack_frames(tid, ev);
+			break;
+	}
+
+}
+
+// 取空所有线程的事件环，返回积压最多的环里的事件数
+int drain_events(void) {
+
+	int backlog = 0;
+	struct event_ring *prev = NULL;
+	struct event_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+	while (ring != NULL) {
+
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		uint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64 tail = ring->tail;
+
+		if (head - tail > backlog)
+			backlog = head - tail;
+
+		for (;tail != head;tail ++) {
+			apply_event(ring->tid, &ring->events[tail & (EVENT_RING_SIZE - 1)]);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (dead) {
+
+			struct source_type self;
+			self.id = ring->tid;
+			self.type = PROCESS;
+
+			int idx = search_vertex(self);
+			if (idx != -1)
+				remove_vertex(idx);
+
+			struct event_ring *next = ring->next;
+			if (prev != NULL) {
+				prev->next = next;
+			} else {
+				// 表头可能正在被新线程 CAS，失败说明前面插入了新节点，从新表头找到前驱再摘除
+				struct event_ring *expected = ring;
+				if (!__atomic_compare_exchange_n(&rings, &expected, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					for (prev = expected; prev->next != ring; prev = prev->next) ;
+					prev->next = next;
+				}
+			}
+			free(ring);
+			ring = next;
+			continue;
+
+		}
+
+		prev = ring;
+		ring = ring->next;
+
+	}
+
+	return backlog;
+}
+
+
+static void *thread_routine(void *args) {
+
+	struct pollfd pfd;
+	struct timespec now;
+	uint64 count, last = 0;
+
+	in_detector = 1;
+	pfd.fd = wake_fd;
+	pfd.events = POLLIN;
+
+	if (profile)
+		profile_calibrate();
+
+	// 环在应用 LOCK_BEFORE 时就地检测，这里只负责取事件，不再定期全图 DFS
+	while (1) {
+
+		// 有环积压过半说明生产得快，不睡眠接着取
+		if (drain_events() < EVENT_RING_SIZE / 2) {
+			if (poll(&pfd, 1, DRAIN_INTERVAL) > 0 && read(wake_fd, &count, sizeof(count)) < 0) {}
+		}
+
+		if (!profile) continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (last == 0) last = now.tv_sec;
+
+		if (profile_dump_request || (lp->interval > 0 && now.tv_sec - last >= lp->interval)) {
+			profile_dump_request = 0;
+			last = now.tv_sec;
+			profile_dump();
+		}
+
+	}
+
+	return NULL;
+}
+
+
+void start_check(void) {
+
+	struct task_graph *g = (struct task_graph*)malloc(sizeof(struct task_graph));
+	g->num = 0;
+	g->cap = HASH_INIT_SIZE;
+	g->list = (struct vertex *)malloc(g->cap * sizeof(struct vertex));
+	hash_init(&g->vertex_index, HASH_INIT_SIZE);
+
+	g->lockidx = 0;
+	g->lockcap = HASH_INIT_SIZE;
+	g->locklist = (struct source_type *)malloc(g->lockcap * sizeof(struct source_type));
+	hash_init(&g->lock_index, HASH_INIT_SIZE);
+
+	g->mark = (int *)calloc(g->cap, sizeof(int));
+	g->stack = (int *)malloc(g->cap * sizeof(int));
+	g->child = (int *)malloc(g->cap * sizeof(int));
+	g->stamp = 0;
+
+	char *mode = getenv("DEADLOCK_LOCKORDER");
+	if (mode && atoi(mode)) {
+		lockorder = 1;
+		order_init();
+	}
+
+	pthread_key_create(&ring_key, ring_release);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	mode = getenv("DEADLOCK_PROFILE");
+	if (mode) {
+
+		void *frames[1];
+
+		profile = 1;
+		profile_init(atoi(mode));
+		signal(SIGUSR2, profile_signal);
+		// 第一次调用 backtrace 会加载 libgcc，提前做掉，不要发生在 hook 里
+		backtrace(frames, 1);
+
+	}
+
+	// 图初始化完成之后 hook 才开始记录事件
+	__atomic_store_n(&tg, g, __ATOMIC_RELEASE);
+	
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, thread_routine, NULL);
+
+}
+
+
+// hook
+// define
+typedef int (*pthread_mutex_lock_t)(pthread_mutex_t *mutex);
+pthread_mutex_lock_t pthread_mutex_lock_f = NULL;
+
+typedef int (*pthread_mutex_unlock_t)(pthread_mutex_t *mutex);
+pthread_mutex_unlock_t pthread_mutex_unlock_f = NULL;
+
+typedef int (*pthread_mutex_trylock_t)(pthread_mutex_t *mutex);
+pthread_mutex_trylock_t pthread_mutex_trylock_f = NULL;
+
+typedef int (*pthread_mutex_timedlock_t)(pthread_mutex_t *mutex, const struct timespec *abstime);
+pthread_mutex_timedlock_t pthread_mutex_timedlock_f = NULL;
+
+typedef int (*pthread_mutex_destroy_t)(pthread_mutex_t *mutex);
+pthread_mutex_destroy_t pthread_mutex_destroy_f = NULL;
+
+typedef int (*pthread_rwlock_lock_t)(pthread_rwlock_t *rwlock);
+pthread_rwlock_lock_t pthread_rwlock_rdlock_f = NULL;
+pthread_rwlock_lock_t pthread_rwlock_wrlock_f = NULL;
+pthread_rwlock_lock_t pthread_rwlock_tryrdlock_f = NULL;
+pthread_rwlock_lock_t pthread_rwlock_trywrlock_f = NULL;
+pthread_rwlock_lock_t pthread_rwlock_unlock_f = NULL;
+pthread_rwlock_lock_t pthread_rwlock_destroy_f = NULL;
+
+typedef int (*pthread_rwlock_timedlock_t)(pthread_rwlock_t *rwlock, const struct timespec *abstime);
+pthread_rwlock_timedlock_t pthread_rwlock_timedrdlock_f = NULL;
+pthread_rwlock_timedlock_t pthread_rwlock_timedwrlock_f = NULL;
+
+typedef int (*pthread_cond_wait_t)(pthread_cond_t *cond, pthread_mutex_t *mutex);
+pthread_cond_wait_t pthread_cond_wait_f = NULL;
+
+typedef int (*pthread_cond_timedwait_t)(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime);
+pthread_cond_timedwait_t pthread_cond_timedwait_f = NULL;
+
+
+// implement
+#define CALLER()	__builtin_return_address(0)
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+
+	// 没有竞争时直接拿到锁，不会形成等待边，省掉 LOCK_BEFORE
+	if (pthread_mutex_trylock_f(mutex) == 0) {
+		record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE, mutex, CALLER());
+	
+	int ret = pthread_mutex_lock_f(mutex);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+
+	return ret;
+}
+
+// trylock 不会阻塞，不产生等待边
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+
+	int ret = pthread_mutex_trylock_f(mutex);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER | EVENT_TRY, mutex, event_clock(), CALLER());
+
+	return ret;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime) {
+
+	if (pthread_mutex_trylock_f(mutex) == 0) {
+		record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE, mutex, CALLER());
+
+	int ret = pthread_mutex_timedlock_f(mutex, abstime);
+
+	// 超时之后不再等待，撤掉等待边
+	if (ret == 0)
+		record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+	else
+		record_event(LOCK_CANCEL, mutex, 0, NULL);
+
+	return ret;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+
+	// 先记录释放再真正解锁，否则其他线程拿到锁的事件可能排在这次释放之前；
+	// 解锁失败(不是持有者)时记录的释放只清掉本线程的持有，没有影响
+	record_event(UNLOCK_AFTER, mutex, UNLOCK_CLOCK(), NULL);
+
+	return pthread_mutex_unlock_f(mutex);
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+
+	// 地址可能被复用成别的锁，锁顺序图里要断开
+	if (lockorder)
+		record_event(LOCK_DESTROY, mutex, 0, NULL);
+
+	return pthread_mutex_destroy_f(mutex);
+}
+
+// 读写锁: 读者之间不互斥，等读锁只会被写锁持有者阻塞，等写锁会被所有持有者阻塞
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+
+	if (pthread_rwlock_tryrdlock_f(rwlock) == 0) {
+		record_event(LOCK_AFTER | EVENT_SHARED, rwlock, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE | EVENT_SHARED, rwlock, CALLER());
+
+	int ret = pthread_rwlock_rdlock_f(rwlock);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER | EVENT_SHARED, rwlock, event_clock(), CALLER());
+	else
+		record_event(LOCK_CANCEL, rwlock, 0, NULL);
+
+	return ret;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+
+	if (pthread_rwlock_trywrlock_f(rwlock) == 0) {
+		record_event(LOCK_AFTER, rwlock, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE, rwlock, CALLER());
+
+	int ret = pthread_rwlock_wrlock_f(rwlock);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER, rwlock, event_clock(), CALLER());
+	else
+		record_event(LOCK_CANCEL, rwlock, 0, NULL);
+
+	return ret;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
+
+	int ret = pthread_rwlock_tryrdlock_f(rwlock);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER | EVENT_SHARED | EVENT_TRY, rwlock, event_clock(), CALLER());
+
+	return ret;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
+
+	int ret = pthread_rwlock_trywrlock_f(rwlock);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER | EVENT_TRY, rwlock, event_clock(), CALLER());
+
+	return ret;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock, const struct timespec *abstime) {
+
+	if (pthread_rwlock_tryrdlock_f(rwlock) == 0) {
+		record_event(LOCK_AFTER | EVENT_SHARED, rwlock, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE | EVENT_SHARED, rwlock, CALLER());
+
+	int ret = pthread_rwlock_timedrdlock_f(rwlock, abstime);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER | EVENT_SHARED, rwlock, event_clock(), CALLER());
+	else
+		record_event(LOCK_CANCEL, rwlock, 0, NULL);
+
+	return ret;
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock, const struct timespec *abstime) {
+
+	if (pthread_rwlock_trywrlock_f(rwlock) == 0) {
+		record_event(LOCK_AFTER, rwlock, event_clock(), CALLER());
+		return 0;
+	}
+
+	record_wait(LOCK_BEFORE, rwlock, CALLER());
+
+	int ret = pthread_rwlock_timedwrlock_f(rwlock, abstime);
+
+	if (ret == 0)
+		record_event(LOCK_AFTER, rwlock, event_clock(), CALLER());
+	else
+		record_event(LOCK_CANCEL, rwlock, 0, NULL);
+
+	return ret;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
+
+	// 和 pthread_mutex_unlock 一样先记录释放
+	record_event(UNLOCK_AFTER, rwlock, UNLOCK_CLOCK(), NULL);
+
+	return pthread_rwlock_unlock_f(rwlock);
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
+
+	if (lockorder)
+		record_event(LOCK_DESTROY, rwlock, 0, NULL);
+
+	return pthread_rwlock_destroy_f(rwlock);
+}
+
+// cond_wait 进入时释放 mutex，返回时(包括超时)已经重新拿到 mutex。
+// 等条件变量不是等锁，不产生等待边；重新拿锁的等待在 glibc 内部，观察不到
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+
+	record_event(UNLOCK_AFTER, mutex, UNLOCK_CLOCK(), NULL);
+
+	int ret = pthread_cond_wait_f(cond, mutex);
+
+	record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+
+	return ret;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
+
+	record_event(UNLOCK_AFTER, mutex, UNLOCK_CLOCK(), NULL);
+
+	int ret = pthread_cond_timedwait_f(cond, mutex, abstime);
+
+	record_event(LOCK_AFTER, mutex, event_clock(), CALLER());
+
+	return ret;
+}
+
+// thread_pool/spinlock.h 是内联函数，没法 dlsym 拦截；
+// 用 -DSPINLOCK_TRACE 编译时它会调用下面三个弱符号，链接了本文件就会被记录
+void spinlock_trace_wait(void *lock) {
+
+	record_wait(LOCK_BEFORE, lock, CALLER());
+
+}
+
+void spinlock_trace_acquired(void *lock, int is_try) {
+
+	record_event(LOCK_AFTER | (is_try ? EVENT_TRY : 0), lock, event_clock(), CALLER());
+
+}
+
+void spinlock_trace_unlock(void *lock) {
+
+	record_event(UNLOCK_AFTER, lock, UNLOCK_CLOCK(), NULL);
+
+}
+
+// init
+// pthread_cond_* 在 glibc 里有新旧两个版本，dlsym 可能拿到旧版本，要指定版本号
+static void *cond_symbol(const char *name) {
+
+	void *f = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+
+	return f ? f : dlsym(RTLD_NEXT, name);
+}
+
+void init_hook(void) {
+
+	if (!pthread_mutex_lock_f)
+		pthread_mutex_lock_f = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+
+	if (!pthread_mutex_unlock_f)
+		pthread_mutex_unlock_f = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+
+	if (!pthread_mutex_trylock_f)
+		pthread_mutex_trylock_f = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+
+	if (!pthread_mutex_timedlock_f)
+		pthread_mutex_timedlock_f = dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
+
+	if (!pthread_mutex_destroy_f)
+		pthread_mutex_destroy_f = dlsym(RTLD_NEXT, "pthread_mutex_destroy");
+
+	if (!pthread_rwlock_rdlock_f)
+		pthread_rwlock_rdlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+
+	if (!pthread_rwlock_wrlock_f)
+		pthread_rwlock_wrlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+
+	if (!pthread_rwlock_tryrdlock_f)
+		pthread_rwlock_tryrdlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
+
+	if (!pthread_rwlock_trywrlock_f)
+		pthread_rwlock_trywrlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
+
+	if (!pthread_rwlock_timedrdlock_f)
+		pthread_rwlock_timedrdlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_timedrdlock");
+
+	if (!pthread_rwlock_timedwrlock_f)
+		pthread_rwlock_timedwrlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_timedwrlock");
+
+	if (!pthread_rwlock_unlock_f)
+		pthread_rwlock_unlock_f = dlsym(RTLD_NEXT, "pthread_rwlock_unlock");
+
+	if (!pthread_rwlock_destroy_f)
+		pthread_rwlock_destroy_f = dlsym(RTLD_NEXT, "pthread_rwlock_destroy");
+
+	if (!pthread_cond_wait_f)
+		pthread_cond_wait_f = cond_symbol("pthread_cond_wait");
+
+	if (!pthread_cond_timedwait_f)
+		pthread_cond_timedwait_f = cond_symbol("pthread_cond_timedwait");
 	
 }
 
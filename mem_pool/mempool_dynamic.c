@@ -8,6 +8,9 @@
 
 #include <fcntl.h>
 
+// 编译时加 -I../memleak_detect；-DMEMLEAK_POOL_TRACE: 借出/归还通知 memleak_detect/memleak.c
+#include "memleak.h"
+
 
 
 #define MP_ALIGNMENT       		32
@@ -41,6 +44,7 @@ struct mp_pool_s {
 
 	struct mp_node_s *current;
 	struct mp_large_s *large;
+	int trace_id;	// memleak 里注册的编号，0 表示没有跟踪
 
 	struct mp_node_s head[0];
 
@@ -50,6 +54,7 @@ struct mp_pool_s *mp_create_pool(size_t size);
 void mp_destory_pool(struct mp_pool_s *pool);
 void *mp_alloc(struct mp_pool_s *pool, size_t size);
 void *mp_nalloc(struct mp_pool_s *pool, size_t size);
+static void *mp_alloc_raw(struct mp_pool_s *pool, size_t size);
 void *mp_calloc(struct mp_pool_s *pool, size_t size);
 void mp_free(struct mp_pool_s *pool, void *p);
 
@@ -65,6 +70,7 @@ struct mp_pool_s *mp_create_pool(size_t size) {
 	p->max = (size < MP_MAX_ALLOC_FROM_POOL) ? size : MP_MAX_ALLOC_FROM_POOL;
 	p->current = p->head;
 	p->large = NULL;
+	p->trace_id = MEMLEAK_POOL_REGISTER("mp_pool");
 
 	p->head->last = (unsigned char *)p + sizeof(struct mp_pool_s) + sizeof(struct mp_node_s);
 	p->head->end = p->head->last + size;
@@ -80,6 +86,8 @@ void mp_destory_pool(struct mp_pool_s *pool) {
 	struct mp_node_s *h, *n;
 	struct mp_large_s *l;
 
+	MEMLEAK_POOL(unregister, pool->trace_id);
+
 	for (l = pool->large; l; l = l->next) {
 		if (l->alloc) {
 			free(l->alloc);
@@ -103,6 +111,8 @@ void mp_reset_pool(struct mp_pool_s *pool) {
 	struct mp_node_s *h;
 	struct mp_large_s *l;
 
+	MEMLEAK_POOL(reset, pool->trace_id);
+
 	for (l = pool->large; l; l = l->next) {
 		if (l->alloc) {
 			free(l->alloc);
@@ -167,7 +177,7 @@ static void *mp_alloc_large(struct mp_pool_s *pool, size_t size) {
 		if (n ++ > 3) break;
 	}
 
-	large = mp_alloc(pool, sizeof(struct mp_large_s));
+	large = mp_alloc_raw(pool, sizeof(struct mp_large_s));
 	if (large == NULL) {
 		free(p);
 		return NULL;
@@ -189,7 +199,7 @@ void *mp_memalign(struct mp_pool_s *pool, size_t size, size_t alignment) {
 		return NULL;
 	}
 
-	struct mp_large_s *large = mp_alloc(pool, sizeof(struct mp_large_s));
+	struct mp_large_s *large = mp_alloc_raw(pool, sizeof(struct mp_large_s));
 	if (large == NULL) {
 		free(p);
 		return NULL;
@@ -199,13 +209,16 @@ void *mp_memalign(struct mp_pool_s *pool, size_t size, size_t alignment) {
 	large->next = pool->large;
 	pool->large = large;
 
+	MEMLEAK_POOL(get, pool->trace_id, p, size);
+
 	return p;
 }
 
 
 
 
-void *mp_alloc(struct mp_pool_s *pool, size_t size) {
+// 池内部的 mp_large_s 也从这里分配，不算借出的对象
+static void *mp_alloc_raw(struct mp_pool_s *pool, size_t size) {
 
 	unsigned char *m;
 	struct mp_node_s *p;
@@ -231,8 +244,16 @@ void *mp_alloc(struct mp_pool_s *pool, size_t size) {
 	
 }
 
+void *mp_alloc(struct mp_pool_s *pool, size_t size) {
 
-void *mp_nalloc(struct mp_pool_s *pool, size_t size) {
+	void *m = mp_alloc_raw(pool, size);
+
+	MEMLEAK_POOL(get, pool->trace_id, m, size);
+
+	return m;
+}
+
+static void *mp_nalloc_raw(struct mp_pool_s *pool, size_t size) {
 
 	unsigned char *m;
 	struct mp_node_s *p;
@@ -256,6 +277,15 @@ void *mp_nalloc(struct mp_pool_s *pool, size_t size) {
 	
 }
 
+void *mp_nalloc(struct mp_pool_s *pool, size_t size) {
+
+	void *m = mp_nalloc_raw(pool, size);
+
+	MEMLEAK_POOL(get, pool->trace_id, m, size);
+
+	return m;
+}
+
 void *mp_calloc(struct mp_pool_s *pool, size_t size) {
 
 	void *p = mp_alloc(pool, size);
@@ -270,6 +300,10 @@ void *mp_calloc(struct mp_pool_s *pool, size_t size) {
 void mp_free(struct mp_pool_s *pool, void *p) {
 
 	struct mp_large_s *l;
+
+	// 小块不会真的释放，但是对使用者来说已经还回去了
+	MEMLEAK_POOL(put, pool->trace_id, p);
+
 	for (l = pool->large; l; l = l->next) {
 		if (p == l->alloc) {
 			free(l->alloc);
@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// 编译时加 -I../memleak_detect；-DMEMLEAK_POOL_TRACE: 借出/归还通知 memleak_detect/memleak.c
+#include "memleak.h"
+
 
 #define MEM_PAGE_SIZE		0x1000
 
@@ -13,6 +16,7 @@ typedef struct mempool_s {
 
 	char *free_ptr;
 	char *mem;
+	int trace_id;	// memleak 里注册的编号，0 表示没有跟踪
 } mempool_t;
 
 
@@ -37,6 +41,8 @@ int memp_init(mempool_t *m, int block_size) {
 	}
 	*(char **)ptr = NULL;
 
+	m->trace_id = MEMLEAK_POOL_REGISTER("mempool");
+
 	return 0;
 }
 
@@ -50,11 +56,15 @@ void* memp_alloc(mempool_t *m) {
 	m->free_ptr = *(char **)ptr;
 	m->free_count --;
 
+	MEMLEAK_POOL(get, m->trace_id, ptr, m->block_size);
+
 	return ptr;
 }
 
 void *memp_free(mempool_t *m, void *ptr) {
 
+	MEMLEAK_POOL(put, m->trace_id, ptr);
+
 	*(char**)ptr = m->free_ptr;
 	m->free_ptr = (char *)ptr;
 	m->free_count ++;
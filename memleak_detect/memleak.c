@@ -1,3 +1,5 @@
+// build: gcc -g -fno-omit-frame-pointer -rdynamic -DMEMLEAK_DEMO -o memleak memleak.c -lpthread -ldl -lm
+// 和池的程序一起链接时不要定义 MEMLEAK_DEMO，否则有两个 main
 
 #define _GNU_SOURCE
 #include <dlfcn.h>
@@ -5,7 +7,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <time.h>
 
 // libc
 
@@ -132,60 +142,581 @@ void init_hook(void) {
 
 #else
 
+// 不再每次分配都建文件: 活着的内存块放在按指针分片的开放寻址哈希表里，
+// 每个分片一把锁，不同线程大多落在不同分片上；需要时调用 memleak_dump 输出，进程退出时自动输出一次。
+// 每个内存块只存一个 4 字节的调用栈编号，调用栈去重后放在全局的栈表里，输出时才符号化。
+// 调用栈按帧指针回溯，被测程序要用 -fno-omit-frame-pointer 编译，否则只有第一层是准的。
+// 采样模式(MEMLEAK_SAMPLE=N): 平均每分配 N 字节采一次样(泊松过程)，只跟踪采到的块，
+// 报告里按采样概率换算成整体的估计值，开销小到可以在线上一直开着。
+// 堆快照: memleak_snapshot() 或者 MEMLEAK_SIGNAL=<信号> 之后 kill -<信号>，记下每个调用栈当前活着的字节数，
+// memleak_diff 按增长的字节数排序输出两个快照之间的差异，找缓存一类慢慢涨的内存；
+// 同时按调用栈统计释放掉的块活了多久(对数直方图)。快照个数和栈表都有上限，内存开销是固定的。
+// 对象池(mp_pool_s/mempool_t/CDBPool/CachePool)通过 memleak.h 里的接口报告借出和归还，
+// 按 池 + 调用栈 输出还没有归还的对象，找借了不还的地方。
+// hook 了整个分配函数族: malloc/calloc/realloc/free/posix_memalign/aligned_alloc/memalign 和 C++ 的 operator new/delete；
+// 防重入的标记是线程私有的，一个线程在 hook 里(比如 dladdr/printf 内部又 malloc)不影响其他线程的记录。
+// 没有符号的帧: addr2line -f -e ./memleak -a 0x400b38
 
 // malloc(); --> __libc_malloc();
 extern void *__libc_malloc(size_t size);
 extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
 
+#define MEM_SHARDS		64	// 分片数，必须是 2 的幂
+#define MEM_SHARD_INIT	256	// 每个分片初始容量，必须是 2 的幂
+#define MEM_STACK_DEPTH	16	// 调用栈最多记录的帧数
+#define MEM_STACKS		65536	// 栈表容量(不扩容，满了之后新的栈记为 0 号)
+#define MEM_TOP_STACKS	20	// 报告中输出的调用栈个数
+#define MEM_SNAPSHOTS	8	// 最多保留的快照个数，更早的丢掉
+#define MEM_LIFETIME_BUCKETS	32	// 生命周期直方图按 2 的幂分桶(ms)
 
-int enable_malloc_hook = 1;
-int enable_free_hook = 1;
+struct mem_block {
+
+	void *ptr;		// NULL 表示空槽
+	uint32_t stack;	// 调用栈编号，0 表示未知
+	uint32_t birth;	// 分配的时间(ms)，回绕了也不影响相减
+	uint64_t size : 48;
+	uint64_t pool : 16;	// 对象池编号，只在 pool_shards 里使用
+
+};
+
+struct stack_trace {
+
+	uint64_t hash;
+	int depth;
+	void *frames[MEM_STACK_DEPTH];
+
+};
+
+// 栈表: traces 按编号存放，index 是 hash -> 编号 的开放寻址表。
+// 只增不删，插入用 CAS，查找不加锁；两块都用 mmap 预留，用到的页才占内存
+struct stack_table {
+
+	struct stack_trace *traces;	// traces[0] 不用
+	uint32_t *index;			// 0 表示空槽
+	uint32_t count;
+	uint32_t (*lifetime)[MEM_LIFETIME_BUCKETS];	// 每个栈释放掉的块活了多久
+
+};
+
+static struct stack_table stacks;
+
+static size_t sample_rate = 0;	// 采样间隔的均值(字节)，0 表示跟踪所有分配
+// 做成 LD_PRELOAD 的 .so 时，动态 TLS 第一次访问会 malloc，所以用 initial-exec
+#define MEM_TLS	__thread __attribute__((tls_model("initial-exec")))
+
+static MEM_TLS int64_t bytes_until_sample;	// 本线程距离下一次采样还有多少字节
+static MEM_TLS uint64_t sample_rng;
+static MEM_TLS int in_hook;	// 本线程正在 hook 里，再分配/释放直接交给 libc
+
+struct mem_shard {
+
+	pthread_mutex_t mutex;
+	struct mem_block *slots;
+	size_t mask;
+	size_t count;
+
+} __attribute__((aligned(64)));
+
+static struct mem_shard shards[MEM_SHARDS];	// malloc 出来的块
+static struct mem_shard pool_shards[MEM_SHARDS];	// 从对象池借出的对象，地址可能和 malloc 的块重叠，单独一张表
+
+
+static inline uint64_t mem_hash(void *ptr) {
+
+	uint64_t h = (uint64_t)(uintptr_t)ptr;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+// 低位选分片，高位定起始槽位
+static inline struct mem_shard *mem_shard_of(struct mem_shard *table, uint64_t h) {
+	return &table[h & (MEM_SHARDS - 1)];
+}
+
+// 哈希表自己的内存直接找 libc 要，不经过 hook
+static int mem_shard_grow(struct mem_shard *sh) {
+
+	size_t cap = sh->slots ? (sh->mask + 1) * 2 : MEM_SHARD_INIT;
+	struct mem_block *slots = (struct mem_block *)__libc_malloc(cap * sizeof(struct mem_block));
+	size_t i = 0;
+
+	if (slots == NULL) return -1;
+	memset(slots, 0, cap * sizeof(struct mem_block));
+
+	for (i = 0;sh->slots && i <= sh->mask;i ++) {
+
+		if (sh->slots[i].ptr == NULL) continue;
+
+		size_t pos = (mem_hash(sh->slots[i].ptr) >> 32) & (cap - 1);
+		while (slots[pos].ptr) pos = (pos + 1) & (cap - 1);
+		slots[pos] = sh->slots[i];
+
+	}
+
+	__libc_free(sh->slots);
+	sh->slots = slots;
+	sh->mask = cap - 1;
+
+	return 0;
+}
+
+static inline uint32_t mem_clock_ms(void) {
+
+	struct timespec ts;
+
+	// 粗粒度时钟走 vdso，只读一次内存，精度(几 ms)对生命周期足够了
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void mem_insert(struct mem_shard *table, void *ptr, uint32_t stack, size_t size, int pool) {
+
+	uint64_t h = mem_hash(ptr);
+	struct mem_shard *sh = mem_shard_of(table, h);
+
+	pthread_mutex_lock(&sh->mutex);
+
+	// 负载超过 3/4 扩容
+	if ((sh->slots == NULL || (sh->count + 1) * 4 > (sh->mask + 1) * 3) && mem_shard_grow(sh)) {
+		pthread_mutex_unlock(&sh->mutex);
+		return ;
+	}
+
+	size_t pos = (h >> 32) & sh->mask;
+	while (sh->slots[pos].ptr) pos = (pos + 1) & sh->mask;
+
+	sh->slots[pos].ptr = ptr;
+	sh->slots[pos].stack = stack;
+	sh->slots[pos].birth = mem_clock_ms();
+	sh->slots[pos].size = size;
+	sh->slots[pos].pool = pool;
+	sh->count ++;
+
+	pthread_mutex_unlock(&sh->mutex);
+
+}
+
+// 找到并删除返回 0，不在表中返回 -1；删除的记录拷到 out 里
+static int mem_remove(struct mem_shard *table, void *ptr, struct mem_block *out) {
+
+	uint64_t h = mem_hash(ptr);
+	struct mem_shard *sh = mem_shard_of(table, h);
+	int ret = -1;
+
+	pthread_mutex_lock(&sh->mutex);
+
+	if (sh->slots) {
+
+		size_t pos = (h >> 32) & sh->mask;
+
+		while (sh->slots[pos].ptr && sh->slots[pos].ptr != ptr)
+			pos = (pos + 1) & sh->mask;
+
+		if (sh->slots[pos].ptr) {
+
+			*out = sh->slots[pos];
+
+			// 后移删除: 把后面探测链上的元素往前挪，不留墓碑
+			size_t hole = pos, next = (pos + 1) & sh->mask;
+
+			while (sh->slots[next].ptr) {
+
+				size_t home = (mem_hash(sh->slots[next].ptr) >> 32) & sh->mask;
+
+				if (((next - home) & sh->mask) >= ((next - hole) & sh->mask)) {
+					sh->slots[hole] = sh->slots[next];
+					hole = next;
+				}
+				next = (next + 1) & sh->mask;
+
+			}
+
+			sh->slots[hole].ptr = NULL;
+			sh->count --;
+			ret = 0;
+
+		}
+
+	}
+
+	pthread_mutex_unlock(&sh->mutex);
+
+	return ret;
+}
+
+
+// 当前线程栈的上界，帧指针超出范围就停止回溯
+static MEM_TLS uintptr_t stack_hi;
+
+static void stack_bounds(void) {
+
+	pthread_attr_t attr;
+	void *addr = NULL;
+	size_t size = 0;
+
+	// pthread_getattr_np 内部会 malloc/free(主线程要读 /proc/self/maps)，调用方已经置了 in_hook
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		pthread_attr_getstack(&attr, &addr, &size);
+		pthread_attr_destroy(&attr);
+	}
+
+	stack_hi = addr ? (uintptr_t)addr + size : (uintptr_t)-1;
+
+}
+
+// 从 fp 开始沿帧指针链回溯: fp[0] 是上一层的 fp，fp[1] 是返回地址
+static inline int stack_unwind(uintptr_t *fp, void **frames) {
+
+	int n = 0;
+
+	if (stack_hi == 0) stack_bounds();
+
+	while (n < MEM_STACK_DEPTH) {
+
+		void *ret = (void *)fp[1];
+		if (ret == NULL) break;
+		frames[n ++] = ret;
+
+		uintptr_t *next = (uintptr_t *)fp[0];
+		// 栈向低地址增长，上一层的帧一定在更高的地址上
+		if (next <= fp || (uintptr_t)next >= stack_hi || ((uintptr_t)next & (sizeof(void *) - 1)))
+			break;
+		fp = next;
+
+	}
+
+	return n;
+}
+
+// 第一次分配时初始化，libstdc++ 等库在构造函数之前就会分配内存
+static pthread_once_t stack_once = PTHREAD_ONCE_INIT;
+
+static void stack_init(void) {
+
+	void *traces = mmap(NULL, MEM_STACKS * sizeof(struct stack_trace), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void *index = mmap(NULL, 2 * MEM_STACKS * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void *lifetime = mmap(NULL, MEM_STACKS * MEM_LIFETIME_BUCKETS * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (traces == MAP_FAILED || index == MAP_FAILED || lifetime == MAP_FAILED) return ;
+
+	stacks.traces = (struct stack_trace *)traces;
+	stacks.lifetime = (uint32_t (*)[MEM_LIFETIME_BUCKETS])lifetime;
+	stacks.count = 1;
+	__atomic_store_n(&stacks.index, (uint32_t *)index, __ATOMIC_RELEASE);
+
+}
+
+// 返回调用栈的编号，相同的栈总是同一个编号
+static uint32_t stack_intern(void **frames, int depth) {
+
+	uint64_t h = 0x9E3779B97F4A7C15ULL;
+	uint32_t mask = 2 * MEM_STACKS - 1;
+	int i = 0;
+
+	if (__atomic_load_n(&stacks.index, __ATOMIC_ACQUIRE) == NULL) {
+		pthread_once(&stack_once, stack_init);
+		if (stacks.index == NULL) return 0;
+	}
+
+	for (i = 0;i < depth;i ++) {
+		h = mem_hash((void *)(h ^ (uintptr_t)frames[i]));
+	}
+
+	uint32_t pos = h & mask;
+
+	while (1) {
+
+		uint32_t id = __atomic_load_n(&stacks.index[pos], __ATOMIC_ACQUIRE);
+
+		if (id == 0) {
+
+			// 先占一个编号把栈写好，再发布到 index；CAS 失败说明别的线程抢先了，重新看这个槽
+			// 满了就不再加，count 停在 MEM_STACKS，不会一直涨到回绕
+			id = __atomic_load_n(&stacks.count, __ATOMIC_RELAXED);
+			do {
+				if (id >= MEM_STACKS) return 0;
+			} while (!__atomic_compare_exchange_n(&stacks.count, &id, id + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+			struct stack_trace *st = &stacks.traces[id];
+			st->hash = h;
+			st->depth = depth;
+			memcpy(st->frames, frames, depth * sizeof(void *));
+
+			uint32_t empty = 0;
+			if (__atomic_compare_exchange_n(&stacks.index[pos], &empty, id, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+				return id;
+
+			// 占的编号浪费掉，不影响正确性
+			id = empty;
+
+		}
+
+		struct stack_trace *st = &stacks.traces[id];
+		if (st->hash == h && st->depth == depth && memcmp(st->frames, frames, depth * sizeof(void *)) == 0)
+			return id;
+
+		pos = (pos + 1) & mask;
+
+	}
+
+}
+
+
+// 下一次采样前要分配的字节数，服从均值为 sample_rate 的指数分布
+static int64_t sample_interval(void) {
+
+	if (sample_rng == 0)
+		sample_rng = ((uint64_t)(uintptr_t)&sample_rng ^ (uint64_t)time(NULL)) | 1;
+
+	// xorshift64*，取高 53 位得到 (0, 1) 上的均匀分布
+	sample_rng ^= sample_rng >> 12;
+	sample_rng ^= sample_rng << 25;
+	sample_rng ^= sample_rng >> 27;
+	double u = ((sample_rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+
+	return (int64_t)(-log(u + 1e-18) * sample_rate) + 1;
+}
+
+// 这次分配要不要记录: 按字节数倒数，数到 0 就采样。
+// 指数分布无记忆，size 字节的块被采到的概率是 1 - exp(-size / sample_rate)
+static inline int sample_hit(size_t size) {
+
+	if (sample_rate == 0) return 1;
+
+	if (bytes_until_sample == 0)
+		bytes_until_sample = sample_interval();
+
+	bytes_until_sample -= size;
+	if (bytes_until_sample > 0) return 0;
+
+	bytes_until_sample = sample_interval();
+	return 1;
+}
+
+// 采到的一个 size 字节的块代表多少个块: 1 / 采样概率
+static double sample_weight(size_t size) {
+
+	if (sample_rate == 0 || size == 0) return 1.0;
+
+	return 1.0 / -expm1(-(double)size / sample_rate);
+}
+
+// 采样模式下绝大多数块不在表里，分片为空就不用加锁查了。
+// 同一个指针的 malloc 一定先于它的 free 返回，不加锁读 count 不会漏掉
+static inline int mem_maybe_tracked(void *ptr) {
+	return __atomic_load_n(&mem_shard_of(shards, mem_hash(ptr))->count, __ATOMIC_RELAXED) != 0;
+}
+
+
+// 下面的函数都在 in_hook 置位之后调用
+
+// 记录一次分配，fp 是 hook 函数自己的帧，回溯出来的第一帧就是调用 hook 的地方
+// main --> f1() --> f2() --> f3() { __builtin_return_address(0)  }
+static inline void mem_track(void *ptr, size_t size, uintptr_t *fp) {
+
+	if (ptr && sample_hit(size)) {
+		void *frames[MEM_STACK_DEPTH];
+		int depth = stack_unwind(fp, frames);
+		mem_insert(shards, ptr, stack_intern(frames, depth), size, 0);
+	}
+
+}
+
+// 释放时记下这个块活了多久
+static inline void mem_lifetime(struct mem_block *b) {
+
+	uint32_t age = mem_clock_ms() - b->birth;
+	int bucket = age ? 32 - __builtin_clz(age) : 0;
+
+	if (b->stack == 0) return ;
+	if (bucket >= MEM_LIFETIME_BUCKETS) bucket = MEM_LIFETIME_BUCKETS - 1;
+
+	__atomic_fetch_add(&stacks.lifetime[b->stack][bucket], 1, __ATOMIC_RELAXED);
+
+}
+
+// 不在表中返回 -1(只有不采样时才说明是重复释放)
+static inline int mem_untrack(void *ptr) {
+
+	struct mem_block b;
+
+	// 采样模式下没采到的块本来就不在表中
+	if (sample_rate && !mem_maybe_tracked(ptr))
+		return 0;
+
+	if (mem_remove(shards, ptr, &b) < 0)
+		return sample_rate ? 0 : -1;
+
+	mem_lifetime(&b);
+
+	return 0;
+}
+
+// operator new 里的 malloc 已经按 malloc 的调用点记录过，改记到 new 的调用点。
+// 沿用 malloc 时的采样结果，没采到的不补记
+static inline void mem_retrack(void *ptr, size_t size, uintptr_t *fp) {
+
+	struct mem_block b;
+
+	if (ptr == NULL) return ;
+	if (sample_rate && !mem_maybe_tracked(ptr)) return ;
+	if (mem_remove(shards, ptr, &b) < 0 && sample_rate) return ;
+
+	void *frames[MEM_STACK_DEPTH];
+	int depth = stack_unwind(fp, frames);
+	mem_insert(shards, ptr, stack_intern(frames, depth), size, 0);
+
+}
+
+static volatile sig_atomic_t snapshot_request = 0;
+static void snapshot_signal(void);
 
 
 void *malloc(size_t size) {
 
 	void *ptr = NULL;
-	if (enable_malloc_hook) {
-		enable_malloc_hook = 0;
+	if (!in_hook) {
+		in_hook = 1;
 	
 		ptr = __libc_malloc(size);
+		mem_track(ptr, size, (uintptr_t *)__builtin_frame_address(0));
 
-	// main --> f1() --> f2() --> f3() { __builtin_return_address(0)  }
+		// 信号处理函数里不能加锁和分配内存，收到信号后由下一次 malloc 来做快照
+		if (snapshot_request)
+			snapshot_signal();
+		
+		in_hook = 0;
+	} else {
+		ptr = __libc_malloc(size);
+	}
+	
+	return ptr;
+}
 
-		void *caller = __builtin_return_address(0);
+void *calloc(size_t nmemb, size_t size) {
 
-		char filename[128] = {0};
-		sprintf(filename, "./mem/%p.mem", ptr);
+	void *ptr = NULL;
+	if (!in_hook) {
+		in_hook = 1;
 
-		FILE *fp = fopen(filename, "w");
-		fprintf(fp, "[+] caller: %p, addr: %p, size: %ld\n", caller, ptr, size);
+		ptr = __libc_calloc(nmemb, size);
+		mem_track(ptr, nmemb * size, (uintptr_t *)__builtin_frame_address(0));
 
-		fflush(fp);
-		
-		enable_malloc_hook = 1;
+		in_hook = 0;
 	} else {
-		ptr = __libc_malloc(size);
+		ptr = __libc_calloc(nmemb, size);
 	}
-	
+
 	return ptr;
 }
 
+void *realloc(void *ptr, size_t size) {
+
+	void *newptr = NULL;
+	if (!in_hook) {
+		in_hook = 1;
+
+		// realloc(ptr, 0) 等于 free，失败时原来的块还在
+		newptr = __libc_realloc(ptr, size);
+		if (ptr && (newptr || size == 0))
+			mem_untrack(ptr);
+		mem_track(newptr, size, (uintptr_t *)__builtin_frame_address(0));
+
+		in_hook = 0;
+	} else {
+		newptr = __libc_realloc(ptr, size);
+	}
+
+	return newptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+
+	void *ptr = NULL;
+	if (!in_hook) {
+		in_hook = 1;
+
+		ptr = __libc_memalign(alignment, size);
+		mem_track(ptr, size, (uintptr_t *)__builtin_frame_address(0));
+
+		in_hook = 0;
+	} else {
+		ptr = __libc_memalign(alignment, size);
+	}
+
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+
+	void *ptr = NULL;
+	if (!in_hook) {
+		in_hook = 1;
+
+		ptr = __libc_memalign(alignment, size);
+		mem_track(ptr, size, (uintptr_t *)__builtin_frame_address(0));
+
+		in_hook = 0;
+	} else {
+		ptr = __libc_memalign(alignment, size);
+	}
+
+	return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+
+	// 对齐必须是 2 的幂，并且是 sizeof(void *) 的倍数
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	void *ptr = NULL;
+	if (!in_hook) {
+		in_hook = 1;
+
+		ptr = __libc_memalign(alignment, size);
+		mem_track(ptr, size, (uintptr_t *)__builtin_frame_address(0));
+
+		in_hook = 0;
+	} else {
+		ptr = __libc_memalign(alignment, size);
+	}
+
+	if (ptr == NULL) return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
 void free(void *ptr) {
 
-	if (enable_free_hook) {
-		enable_free_hook = 0;
-        
-        char buff[128] = {0};
-		sprintf(buff, "./mem/%p.mem", ptr);
+	if (ptr == NULL) return ;
 
-		if (unlink(buff) < 0) { // filename no exist;
+	if (!in_hook) {
+		in_hook = 1;
+
+		if (mem_untrack(ptr) < 0) { // 不在表中
 			printf("double free: %p\n", ptr);
+			in_hook = 0;
 			return ;
 		}
 
 		__libc_free(ptr);
 
-		enable_free_hook = 1;
+		in_hook = 0;
 	} else {
 
 		__libc_free(ptr);
@@ -195,13 +726,652 @@ void free(void *ptr) {
 }
 
 
+// C++ 的 operator new/delete: 按修饰后的名字定义，覆盖 libstdc++ 里的版本。
+// 真正的分配还是交给 libstdc++(失败时抛 bad_alloc、调用 new_handler)，
+// 调用它时不能置 in_hook，抛出异常就没机会清掉了；它内部的 malloc 照常记录，
+// 返回之后再改记到 new 的调用点。找不到 libstdc++ 的版本时直接用 libc 分配释放。
+
+static void *cxx_symbol(void **real, const char *name) {
+
+	if (*real == NULL)
+		*real = dlsym(RTLD_NEXT, name);
+
+	return *real;
+}
+
+#define CXX_NEW(sym, params, args, fallback) \
+	void *sym params { \
+		static void *real = NULL; \
+		void *(*fn) params = (void *(*) params)cxx_symbol(&real, #sym); \
+		void *ptr = NULL; \
+		int outer = !in_hook; \
+		ptr = fn ? fn args : fallback; \
+		if (outer) { \
+			in_hook = 1; \
+			if (fn) \
+				mem_retrack(ptr, size, (uintptr_t *)__builtin_frame_address(0)); \
+			else \
+				mem_track(ptr, size, (uintptr_t *)__builtin_frame_address(0)); \
+			in_hook = 0; \
+		} \
+		return ptr; \
+	}
+
+#define CXX_DELETE(sym, params, args) \
+	void sym params { \
+		static void *real = NULL; \
+		void (*fn) params = (void (*) params)cxx_symbol(&real, #sym); \
+		int outer = !in_hook; \
+		if (ptr == NULL) return ; \
+		in_hook = 1; \
+		if (outer && mem_untrack(ptr) < 0) { \
+			printf("double delete: %p\n", ptr); \
+			in_hook = 0; \
+			return ; \
+		} \
+		if (fn) \
+			fn args; \
+		else \
+			__libc_free(ptr); \
+		if (outer) in_hook = 0; \
+	}
+
+// new(size), new[](size), nothrow 和 C++17 align_val_t 版本
+CXX_NEW(_Znwm, (size_t size), (size), __libc_malloc(size))
+CXX_NEW(_Znam, (size_t size), (size), __libc_malloc(size))
+CXX_NEW(_ZnwmRKSt9nothrow_t, (size_t size, const void *nt), (size, nt), __libc_malloc(size))
+CXX_NEW(_ZnamRKSt9nothrow_t, (size_t size, const void *nt), (size, nt), __libc_malloc(size))
+CXX_NEW(_ZnwmSt11align_val_t, (size_t size, size_t align), (size, align), __libc_memalign(align, size))
+CXX_NEW(_ZnamSt11align_val_t, (size_t size, size_t align), (size, align), __libc_memalign(align, size))
+CXX_NEW(_ZnwmSt11align_val_tRKSt9nothrow_t, (size_t size, size_t align, const void *nt), (size, align, nt), __libc_memalign(align, size))
+CXX_NEW(_ZnamSt11align_val_tRKSt9nothrow_t, (size_t size, size_t align, const void *nt), (size, align, nt), __libc_memalign(align, size))
+
+// delete(ptr), delete[](ptr)，带 size、nothrow 和 align_val_t 的版本
+CXX_DELETE(_ZdlPv, (void *ptr), (ptr))
+CXX_DELETE(_ZdaPv, (void *ptr), (ptr))
+CXX_DELETE(_ZdlPvm, (void *ptr, size_t size), (ptr, size))
+CXX_DELETE(_ZdaPvm, (void *ptr, size_t size), (ptr, size))
+CXX_DELETE(_ZdlPvRKSt9nothrow_t, (void *ptr, const void *nt), (ptr, nt))
+CXX_DELETE(_ZdaPvRKSt9nothrow_t, (void *ptr, const void *nt), (ptr, nt))
+CXX_DELETE(_ZdlPvSt11align_val_t, (void *ptr, size_t align), (ptr, align))
+CXX_DELETE(_ZdaPvSt11align_val_t, (void *ptr, size_t align), (ptr, align))
+CXX_DELETE(_ZdlPvmSt11align_val_t, (void *ptr, size_t size, size_t align), (ptr, size, align))
+CXX_DELETE(_ZdaPvmSt11align_val_t, (void *ptr, size_t size, size_t align), (ptr, size, align))
+
+
+struct stack_leak {
+
+	uint32_t stack;
+	double blocks;	// 采样模式下是估计值
+	double bytes;
+
+};
+
+static int stack_leak_cmp(const void *a, const void *b) {
+
+	const struct stack_leak *x = (const struct stack_leak *)a;
+	const struct stack_leak *y = (const struct stack_leak *)b;
+
+	return x->bytes < y->bytes ? 1 : (x->bytes > y->bytes ? -1 : 0);
+}
+
+// 有符号输出 函数名+偏移，否则输出 模块+偏移(可以直接交给 addr2line)
+static void print_frame(FILE *fp, void *addr) {
+
+	Dl_info info;
+
+	if (dladdr(addr, &info) && info.dli_sname)
+		fprintf(fp, "%s+%#lx", info.dli_sname, (uintptr_t)addr - (uintptr_t)info.dli_saddr);
+	else if (info.dli_fname)
+		fprintf(fp, "%s+%#lx", info.dli_fname, (uintptr_t)addr - (uintptr_t)info.dli_fbase);
+	else
+		fprintf(fp, "%p", addr);
+
+}
+
+// 把所有分片里活着的块按栈编号累加，返回下标就是栈编号的数组(调用方 __libc_free)
+// 逐个分片加锁，其他线程照常分配释放，结果不是严格的同一时刻，但每个分片内部是一致的
+static struct stack_leak *mem_collect(uint32_t *count) {
+
+	int i = 0;
+	size_t j = 0;
+
+	uint32_t nstacks = __atomic_load_n(&stacks.count, __ATOMIC_ACQUIRE);
+	if (nstacks > MEM_STACKS) nstacks = MEM_STACKS;
+	if (nstacks == 0) nstacks = 1;
+
+	struct stack_leak *leaks = (struct stack_leak *)__libc_malloc(nstacks * sizeof(struct stack_leak));
+	if (leaks == NULL) return NULL;
+	memset(leaks, 0, nstacks * sizeof(struct stack_leak));
+
+	for (i = 0;i < MEM_SHARDS;i ++) {
+
+		struct mem_shard *sh = &shards[i];
+
+		pthread_mutex_lock(&sh->mutex);
+
+		for (j = 0;sh->slots && j <= sh->mask;j ++) {
+
+			struct mem_block *b = &sh->slots[j];
+			if (b->ptr == NULL) continue;
+
+			// 统计之后才登记的栈算到 0 号里
+			uint32_t id = b->stack < nstacks ? b->stack : 0;
+			double w = sample_weight(b->size);
+			leaks[id].blocks += w;
+			leaks[id].bytes += w * b->size;
+
+		}
+
+		pthread_mutex_unlock(&sh->mutex);
+
+	}
+
+	for (j = 0;j < nstacks;j ++) {
+		leaks[j].stack = j;
+	}
+
+	*count = nstacks;
+	return leaks;
+}
+
+static void print_stack(FILE *fp, uint32_t id) {
+
+	int k = 0;
+
+	if (id == 0) {
+		fprintf(fp, "        (unknown)\n");
+		return ;
+	}
+
+	struct stack_trace *st = &stacks.traces[id];
+	for (k = 0;k < st->depth;k ++) {
+		fprintf(fp, "        ");
+		print_frame(fp, st->frames[k]);
+		fprintf(fp, "\n");
+	}
+
+}
+
+// 输出当前还没有释放的内存，按调用栈汇总，字节数多的在前；fp 为 NULL 时输出到 stderr
+// 先汇总到按栈编号的数组里，打印时不持有分片的锁
+void memleak_dump(FILE *fp) {
+
+	uint32_t j = 0, nstacks = 0;
+	double n = 0, total = 0;
+
+	if (fp == NULL) fp = stderr;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	struct stack_leak *leaks = mem_collect(&nstacks);
+	if (leaks == NULL) {
+		if (outer) in_hook = 0;
+		return ;
+	}
+
+	for (j = 0;j < nstacks;j ++) {
+		n += leaks[j].blocks;
+		total += leaks[j].bytes;
+	}
+	qsort(leaks, nstacks, sizeof(struct stack_leak), stack_leak_cmp);
+
+	for (j = 0;j < nstacks && j < MEM_TOP_STACKS && leaks[j].blocks;j ++) {
+		fprintf(fp, "[+] %.0f bytes in %.0f blocks, stack #%u\n", leaks[j].bytes, leaks[j].blocks, leaks[j].stack);
+		print_stack(fp, leaks[j].stack);
+	}
+
+	if (sample_rate)
+		fprintf(fp, "leak (estimated, sampled every %ld bytes): %.0f blocks, %.0f bytes, %u stacks\n", sample_rate, n, total, nstacks - 1);
+	else
+		fprintf(fp, "leak: %.0f blocks, %.0f bytes, %u stacks\n", n, total, nstacks - 1);
+	fflush(fp);
+
+	__libc_free(leaks);
+
+	if (outer) in_hook = 0;
+
+}
+
+
+// 快照只存有活着的块的栈，按栈编号排好序，diff 时归并
+struct heap_snapshot {
+
+	int seq;			// 从 1 开始，0 表示空位
+	uint32_t when;		// 拍快照的时间(ms)
+	uint32_t count;
+	struct stack_leak *entries;
+
+};
 
+static struct heap_snapshot snapshots[MEM_SNAPSHOTS];
+static int snapshot_seq = 0;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct heap_snapshot *snapshot_find(int seq) {
+
+	struct heap_snapshot *snap = &snapshots[seq % MEM_SNAPSHOTS];
+
+	return (seq > 0 && snap->seq == seq) ? snap : NULL;
+}
+
+// 拍一个快照，返回编号；只保留最近 MEM_SNAPSHOTS 个，失败返回 -1
+int memleak_snapshot(void) {
+
+	uint32_t j = 0, n = 0, nstacks = 0;
+	int seq = -1;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	struct stack_leak *leaks = mem_collect(&nstacks);
+
+	if (leaks) {
+
+		// 就地压缩掉没有活着的块的栈
+		for (j = 0;j < nstacks;j ++) {
+			if (leaks[j].blocks > 0)
+				leaks[n ++] = leaks[j];
+		}
+
+		pthread_mutex_lock(&snapshot_mutex);
+
+		seq = ++ snapshot_seq;
+		struct heap_snapshot *snap = &snapshots[seq % MEM_SNAPSHOTS];
+
+		__libc_free(snap->entries);
+		snap->seq = seq;
+		snap->when = mem_clock_ms();
+		snap->count = n;
+		snap->entries = leaks;
+
+		pthread_mutex_unlock(&snapshot_mutex);
+
+	}
+
+	if (outer) in_hook = 0;
+
+	return seq;
+}
+
+static void print_lifetime(FILE *fp, uint32_t id) {
+
+	int i = 0, any = 0;
+
+	if (id == 0) return ;
+
+	for (i = 0;i < MEM_LIFETIME_BUCKETS;i ++) {
+
+		uint32_t n = __atomic_load_n(&stacks.lifetime[id][i], __ATOMIC_RELAXED);
+		if (n == 0) continue;
+
+		if (!any) fprintf(fp, "    freed after:");
+		any = 1;
+
+		if (i == 0)
+			fprintf(fp, " <1ms %u", n);
+		else
+			fprintf(fp, " <%ums %u", 1U << i, n);
+
+	}
+
+	fprintf(fp, any ? "\n" : "    nothing freed yet\n");
+
+}
+
+// 输出快照 from 到 to 之间活着的字节数增长最多的调用栈，fp 为 NULL 时输出到 stderr
+void memleak_diff(FILE *fp, int from, int to) {
+
+	uint32_t i = 0, j = 0, n = 0;
+
+	if (fp == NULL) fp = stderr;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	struct heap_snapshot *a = snapshot_find(from), *b = snapshot_find(to);
+
+	if (a == NULL || b == NULL) {
+		fprintf(fp, "snapshot %d or %d not found\n", from, to);
+		pthread_mutex_unlock(&snapshot_mutex);
+		if (outer) in_hook = 0;
+		return ;
+	}
+
+	// delta 复用 stack_leak: blocks/bytes 存的是增量
+	struct stack_leak *delta = (struct stack_leak *)__libc_malloc((a->count + b->count + 1) * sizeof(struct stack_leak));
+	double total_a = 0, total_b = 0;
+
+	while (delta && (i < a->count || j < b->count)) {
+
+		if (j == b->count || (i < a->count && a->entries[i].stack < b->entries[j].stack)) {
+			delta[n] = a->entries[i ++];
+			delta[n].blocks = -delta[n].blocks;
+			delta[n].bytes = -delta[n].bytes;
+		} else if (i == a->count || b->entries[j].stack < a->entries[i].stack) {
+			delta[n] = b->entries[j ++];
+		} else {
+			delta[n] = b->entries[j];
+			delta[n].blocks -= a->entries[i].blocks;
+			delta[n].bytes -= a->entries[i].bytes;
+			i ++, j ++;
+		}
+
+		n ++;
+
+	}
+
+	for (i = 0;i < a->count;i ++) total_a += a->entries[i].bytes;
+	for (i = 0;i < b->count;i ++) total_b += b->entries[i].bytes;
+
+	fprintf(fp, "==== heap growth: snapshot %d -> %d (%.1fs), live %.0f -> %.0f bytes ====\n",
+		from, to, (uint32_t)(b->when - a->when) / 1000.0, total_a, total_b);
+
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (delta) {
+
+		qsort(delta, n, sizeof(struct stack_leak), stack_leak_cmp);
+
+		for (i = 0;i < n && i < MEM_TOP_STACKS && delta[i].bytes > 0;i ++) {
+			fprintf(fp, "[+] %+.0f bytes %+.0f blocks, stack #%u\n", delta[i].bytes, delta[i].blocks, delta[i].stack);
+			print_stack(fp, delta[i].stack);
+			print_lifetime(fp, delta[i].stack);
+		}
+
+		__libc_free(delta);
+
+	}
+
+	fflush(fp);
+
+	if (outer) in_hook = 0;
+
+}
+
+static void snapshot_handler(int sig) {
+	snapshot_request = 1;
+}
+
+// 收到信号之后: 拍快照，和上一个快照比较
+static void snapshot_signal(void) {
+
+	snapshot_request = 0;
+
+	int seq = memleak_snapshot();
+
+	if (seq > 1)
+		memleak_diff(NULL, seq - 1, seq);
+	else if (seq == 1)
+		fprintf(stderr, "heap snapshot 1 taken\n");
+
+}
+
+
+// 对象池: 每个池注册一个编号，借出/归还的对象放在 pool_shards 里，
+// 对象还在 malloc 出来的大块内存里面，不能和 malloc 的块放在同一张表
+
+#define MEM_POOLS		1024	// 同时注册的池的个数上限
+#define MEM_POOL_NAME	32
+
+struct mem_pool {
+
+	int used;
+	char name[MEM_POOL_NAME];
+	uint64_t gets;		// 借出次数
+	uint64_t puts;		// 归还次数
+	uint64_t bad_puts;	// 归还了没有借出(或者已经还过)的对象
+
+};
+
+static struct mem_pool pools[MEM_POOLS];	// pools[0] 不用，0 表示没有注册
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// 注册一个池，返回编号；池满了返回 0，之后对这个池的调用都忽略
+int memleak_pool_register(const char *name) {
+
+	int i = 0;
+
+	pthread_mutex_lock(&pool_mutex);
+
+	for (i = 1;i < MEM_POOLS;i ++) {
+		if (!pools[i].used) break;
+	}
+
+	if (i < MEM_POOLS) {
+		memset(&pools[i], 0, sizeof(struct mem_pool));
+		pools[i].used = 1;
+		strncpy(pools[i].name, name ? name : "", MEM_POOL_NAME - 1);
+	} else {
+		i = 0;
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
+
+	return i;
+}
+
+// 丢掉池 pool 所有还没归还的对象: 把每个分片里不属于它的块重新插一遍
+static void pool_forget(int pool) {
+
+	int i = 0;
+	size_t j = 0;
+
+	for (i = 0;i < MEM_SHARDS;i ++) {
+
+		struct mem_shard *sh = &pool_shards[i];
+
+		pthread_mutex_lock(&sh->mutex);
+
+		if (sh->count == 0) {
+			pthread_mutex_unlock(&sh->mutex);
+			continue;
+		}
+
+		size_t cap = sh->mask + 1;
+		struct mem_block *slots = (struct mem_block *)__libc_malloc(cap * sizeof(struct mem_block));
+		if (slots == NULL) {
+			pthread_mutex_unlock(&sh->mutex);
+			continue;
+		}
+		memset(slots, 0, cap * sizeof(struct mem_block));
+
+		for (j = 0, sh->count = 0;j < cap;j ++) {
+
+			if (sh->slots[j].ptr == NULL || sh->slots[j].pool == pool) continue;
+
+			size_t pos = (mem_hash(sh->slots[j].ptr) >> 32) & sh->mask;
+			while (slots[pos].ptr) pos = (pos + 1) & sh->mask;
+			slots[pos] = sh->slots[j];
+			sh->count ++;
+
+		}
+
+		__libc_free(sh->slots);
+		sh->slots = slots;
+
+		pthread_mutex_unlock(&sh->mutex);
+
+	}
+
+}
+
+// 池整体重置(比如 mp_reset_pool)，之前借出的对象都算归还
+void memleak_pool_reset(int pool) {
+
+	if (pool <= 0 || pool >= MEM_POOLS) return ;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	pool_forget(pool);
+
+	if (outer) in_hook = 0;
+
+}
+
+// 池销毁，编号可以给新的池用
+void memleak_pool_unregister(int pool) {
+
+	if (pool <= 0 || pool >= MEM_POOLS) return ;
+
+	memleak_pool_reset(pool);
+
+	pthread_mutex_lock(&pool_mutex);
+	pools[pool].used = 0;
+	pthread_mutex_unlock(&pool_mutex);
+
+}
+
+// 从池里借出了 obj，调用栈从调用方开始记
+void memleak_pool_get(int pool, void *obj, size_t size) {
+
+	if (pool <= 0 || pool >= MEM_POOLS || obj == NULL) return ;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	void *frames[MEM_STACK_DEPTH];
+	int depth = stack_unwind((uintptr_t *)__builtin_frame_address(0), frames);
+
+	mem_insert(pool_shards, obj, stack_intern(frames, depth), size, pool);
+	__atomic_fetch_add(&pools[pool].gets, 1, __ATOMIC_RELAXED);
+
+	if (outer) in_hook = 0;
+
+}
+
+// obj 还回了池里
+void memleak_pool_put(int pool, void *obj) {
+
+	struct mem_block b;
+
+	if (pool <= 0 || pool >= MEM_POOLS || obj == NULL) return ;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	if (mem_remove(pool_shards, obj, &b) == 0) {
+		mem_lifetime(&b);
+		__atomic_fetch_add(&pools[pool].puts, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&pools[pool].bad_puts, 1, __ATOMIC_RELAXED);
+	}
+
+	if (outer) in_hook = 0;
+
+}
+
+static int pool_block_cmp(const void *a, const void *b) {
+
+	const struct mem_block *x = (const struct mem_block *)a;
+	const struct mem_block *y = (const struct mem_block *)b;
+
+	if (x->pool != y->pool) return x->pool < y->pool ? -1 : 1;
+	if (x->stack != y->stack) return x->stack < y->stack ? -1 : 1;
+
+	// 同一个地方借出的，最老的排在前面
+	return (int32_t)(x->birth - y->birth) < 0 ? -1 : ((int32_t)(x->birth - y->birth) > 0);
+}
+
+// 按 池 + 调用栈 输出还没归还的对象，fp 为 NULL 时输出到 stderr
+void memleak_pool_dump(FILE *fp) {
+
+	int i = 0;
+	size_t j = 0, k = 0, n = 0, cap = 0;
+	struct mem_block *blocks = NULL;
+
+	if (fp == NULL) fp = stderr;
+
+	int outer = !in_hook;
+	in_hook = 1;
+
+	// 先估个数量分配好，拷贝时超出的部分丢掉
+	for (i = 0;i < MEM_SHARDS;i ++) {
+		cap += __atomic_load_n(&pool_shards[i].count, __ATOMIC_RELAXED);
+	}
+	cap += cap / 4 + 16;
+	blocks = (struct mem_block *)__libc_malloc(cap * sizeof(struct mem_block));
+
+	for (i = 0;blocks && i < MEM_SHARDS;i ++) {
+
+		struct mem_shard *sh = &pool_shards[i];
+
+		pthread_mutex_lock(&sh->mutex);
+		for (j = 0;sh->slots && j <= sh->mask && n < cap;j ++) {
+			if (sh->slots[j].ptr)
+				blocks[n ++] = sh->slots[j];
+		}
+		pthread_mutex_unlock(&sh->mutex);
+
+	}
+
+	qsort(blocks, n, sizeof(struct mem_block), pool_block_cmp);
+
+	uint32_t now = mem_clock_ms();
+
+	for (i = 1;i < MEM_POOLS;i ++) {
+
+		if (!pools[i].used) continue;
+
+		fprintf(fp, "==== pool %s (#%d): get %lu, put %lu, bad put %lu ====\n", pools[i].name, i,
+			pools[i].gets, pools[i].puts, pools[i].bad_puts);
+
+		// blocks 按 池、栈 排好序，一段相同的 (池, 栈) 汇总输出一次
+		for (j = 0;j < n;j = k) {
+
+			size_t bytes = 0;
+
+			for (k = j;k < n && blocks[k].pool == blocks[j].pool && blocks[k].stack == blocks[j].stack;k ++) {
+				bytes += blocks[k].size;
+			}
+			if (blocks[j].pool != i) continue;
+
+			fprintf(fp, "[+] %ld objects (%ld bytes) outstanding, oldest %.1fs, stack #%u\n", k - j, bytes,
+				(uint32_t)(now - blocks[j].birth) / 1000.0, blocks[j].stack);
+			print_stack(fp, blocks[j].stack);
+
+		}
+
+	}
+
+	fflush(fp);
+	__libc_free(blocks);
+
+	if (outer) in_hook = 0;
+
+}
+
+__attribute__((constructor)) static void memleak_init(void) {
+
+	int i = 0;
+
+	for (i = 0;i < MEM_SHARDS;i ++) {
+		pthread_mutex_init(&shards[i].mutex, NULL);
+		pthread_mutex_init(&pool_shards[i].mutex, NULL);
+	}
+
+	const char *rate = getenv("MEMLEAK_SAMPLE");
+	if (rate) sample_rate = strtoul(rate, NULL, 10);
+
+	const char *sig = getenv("MEMLEAK_SIGNAL");
+	if (sig) signal(atoi(sig), snapshot_handler);
+
+}
+
+__attribute__((destructor)) static void memleak_exit(void) {
+	memleak_dump(NULL);
+	memleak_pool_dump(NULL);
+}
 
 #endif
 // 
 //
 
-#if 1
+#ifdef MEMLEAK_DEMO
 
 int main() {
 
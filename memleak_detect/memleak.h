@@ -0,0 +1,38 @@
+#ifndef _MARK_MEMLEAK_
+#define _MARK_MEMLEAK_
+
+#include <stdio.h>
+#include <stddef.h>
+
+// 对象池向 memleak.c 报告借出和归还，用来找借了不还的对象(连接、池里切出来的内存)。
+// 都是弱符号: 没有链接 memleak.c 时函数地址为 NULL，下面的宏什么都不做。
+// 池的代码总是包含本头文件，没有定义 MEMLEAK_POOL_TRACE 时宏展开为空，不产生任何调用。
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int memleak_pool_register(const char *name) __attribute__((weak));
+void memleak_pool_unregister(int pool) __attribute__((weak));
+void memleak_pool_reset(int pool) __attribute__((weak));
+void memleak_pool_get(int pool, void *obj, size_t size) __attribute__((weak));
+void memleak_pool_put(int pool, void *obj) __attribute__((weak));
+void memleak_pool_dump(FILE *fp) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+// 返回池的编号，0 表示没有跟踪
+#ifdef MEMLEAK_POOL_TRACE
+#define MEMLEAK_POOL_REGISTER(name)	(memleak_pool_register ? memleak_pool_register(name) : 0)
+#define MEMLEAK_POOL(fn, pool, ...)	do { if ((pool) && memleak_pool_##fn) memleak_pool_##fn(pool, ##__VA_ARGS__); } while (0)
+#else
+#define MEMLEAK_POOL_REGISTER(name)	0
+#define MEMLEAK_POOL(fn, pool, ...)	((void)0)
+#endif
+
+// MEMLEAK_POOL(get, id, obj, size);  MEMLEAK_POOL(put, id, obj);
+// MEMLEAK_POOL(reset, id);  MEMLEAK_POOL(unregister, id);
+
+#endif
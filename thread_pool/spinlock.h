@@ -8,6 +8,22 @@
 
 #ifndef USE_PTHREAD_LOCK
 
+// -DSPINLOCK_TRACE: 加锁解锁时通知 deadlock_detect/deadlock.c(弱符号，没有链接时不调用)
+#ifdef SPINLOCK_TRACE
+#ifdef __cplusplus
+extern "C" {
+#endif
+void spinlock_trace_wait(void *lock) __attribute__((weak));
+void spinlock_trace_acquired(void *lock, int is_try) __attribute__((weak));
+void spinlock_trace_unlock(void *lock) __attribute__((weak));
+#ifdef __cplusplus
+}
+#endif
+#define SPIN_TRACE(fn, ...) do { if (fn) fn(__VA_ARGS__); } while (0)
+#else
+#define SPIN_TRACE(fn, ...) ((void)0)
+#endif
+
 #ifdef __STDC_NO_ATOMICS__
 
 #define atomic_flag_ int
@@ -27,16 +43,26 @@ spinlock_init(struct spinlock *lock) {
 
 static inline void
 spinlock_lock(struct spinlock *lock) {
-	while (atomic_flag_test_and_set_(&lock->lock)) {}
+	if (atomic_flag_test_and_set_(&lock->lock)) {
+		SPIN_TRACE(spinlock_trace_wait, lock);
+		while (atomic_flag_test_and_set_(&lock->lock)) {}
+	}
+	SPIN_TRACE(spinlock_trace_acquired, lock, 0);
 }
 
 static inline int
 spinlock_trylock(struct spinlock *lock) {
-	return atomic_flag_test_and_set_(&lock->lock) == 0;
+	if (atomic_flag_test_and_set_(&lock->lock) == 0) {
+		SPIN_TRACE(spinlock_trace_acquired, lock, 1);
+		return 1;
+	}
+	return 0;
 }
 
 static inline void
 spinlock_unlock(struct spinlock *lock) {
+	// 先记录释放再清标志，否则其他线程拿到锁的事件可能排在这次释放之前
+	SPIN_TRACE(spinlock_trace_unlock, lock);
 	atomic_flag_clear_(&lock->lock);
 }
 
@@ -71,9 +97,16 @@ spinlock_init(struct spinlock *lock) {
 
 static inline void
 spinlock_lock(struct spinlock *lock) {
+	int waited = 0;
 	for (;;) {
-		if (!atomic_test_and_set_(&lock->lock))
+		if (!atomic_test_and_set_(&lock->lock)) {
+			SPIN_TRACE(spinlock_trace_acquired, lock, 0);
 			return;
+		}
+		if (!waited) {
+			waited = 1;
+			SPIN_TRACE(spinlock_trace_wait, lock);
+		}
 		while (atomic_load_relaxed_(&lock->lock))
 			atomic_pause_();
 	}
@@ -81,12 +114,17 @@ spinlock_lock(struct spinlock *lock) {
 
 static inline int
 spinlock_trylock(struct spinlock *lock) {
-	return !atomic_load_relaxed_(&lock->lock) &&
-		!atomic_test_and_set_(&lock->lock);
+	if (!atomic_load_relaxed_(&lock->lock) &&
+		!atomic_test_and_set_(&lock->lock)) {
+		SPIN_TRACE(spinlock_trace_acquired, lock, 1);
+		return 1;
+	}
+	return 0;
 }
 
 static inline void
 spinlock_unlock(struct spinlock *lock) {
+	SPIN_TRACE(spinlock_trace_unlock, lock);
 	atomic_clear_(&lock->lock);
 }
 
@@ -0,0 +1,156 @@
+#include <string.h>
+#include "dheap.h"
+
+#define dheap_parent(i)         (((i) - 1) / DHEAP_D)
+#define dheap_first_child(i)    ((i) * DHEAP_D + 1)
+
+void dheap_ctor_(dheap_t* s) { s->base = 0; s->p = 0; s->n = 0; s->a = 0; }
+void dheap_dtor_(dheap_t* s) { if (s->base) free(s->base); }
+int dheap_empty_(dheap_t* s) { return 0u == s->n; }
+unsigned dheap_size_(dheap_t* s) { return s->n; }
+timer_entry_t* dheap_top_(dheap_t* s) { return s->n ? s->p[0].e : 0; }
+
+static inline void
+dheap_place_(dheap_t* s, unsigned index, uint32_t time, timer_entry_t* e)
+{
+    s->p[index].time = time;
+    s->p[index].e = e;
+    e->min_heap_idx = index;
+}
+
+int dheap_push_(dheap_t* s, timer_entry_t* e)
+{
+    if (dheap_reserve_(s, s->n + 1))
+        return -1;
+    dheap_shift_up_(s, s->n++, e->time, e);
+    return 0;
+}
+
+/* 批量插入: 新增数量少时逐个上浮，否则追加到末尾后自底向上建堆 O(n) */
+int dheap_push_bulk_(dheap_t* s, timer_entry_t** es, unsigned k)
+{
+    unsigned i;
+    if (dheap_reserve_(s, s->n + k))
+        return -1;
+    if (k < s->n)
+    {
+        for (i = 0; i < k; i++)
+            dheap_shift_up_(s, s->n++, es[i]->time, es[i]);
+        return 0;
+    }
+    for (i = 0; i < k; i++, s->n++)
+        dheap_place_(s, s->n, es[i]->time, es[i]);
+    if (s->n < 2)
+        return 0;
+    for (i = dheap_parent(s->n - 1) + 1; i-- > 0;)
+        dheap_shift_down_(s, i, s->p[i].time, s->p[i].e);
+    return 0;
+}
+
+timer_entry_t* dheap_pop_(dheap_t* s)
+{
+    if (s->n)
+    {
+        timer_entry_t* e = s->p[0].e;
+        dheap_node_t last = s->p[--s->n];
+        if (s->n)
+            dheap_shift_down_(s, 0u, last.time, last.e);
+        e->min_heap_idx = -1;
+        return e;
+    }
+    return 0;
+}
+
+int dheap_erase_(dheap_t* s, timer_entry_t* e)
+{
+    if (-1 != e->min_heap_idx)
+    {
+        unsigned index = e->min_heap_idx;
+        dheap_node_t last = s->p[--s->n];
+        /* 和二叉堆一样，用最后一个元素填补空洞，只可能向上或者向下其中一个方向调整 */
+        if (index < s->n)
+        {
+            if (index > 0 && s->p[dheap_parent(index)].time > last.time)
+                dheap_shift_up_(s, index, last.time, last.e);
+            else
+                dheap_shift_down_(s, index, last.time, last.e);
+        }
+        e->min_heap_idx = -1;
+        return 0;
+    }
+    return -1;
+}
+
+int dheap_adjust_(dheap_t *s, timer_entry_t *e)
+{
+    if (-1 == e->min_heap_idx) {
+        return dheap_push_(s, e);
+    } else {
+        unsigned index = e->min_heap_idx;
+        if (index > 0 && s->p[dheap_parent(index)].time > e->time)
+            dheap_shift_up_(s, index, e->time, e);
+        else
+            dheap_shift_down_(s, index, e->time, e);
+        return 0;
+    }
+}
+
+// realloc 不保证对齐，这里用 posix_memalign 重新分配再拷贝
+int dheap_reserve_(dheap_t* s, unsigned n)
+{
+    if (s->a < n)
+    {
+        void *base;
+        unsigned a = s->a ? s->a * 2 : 8;
+        if (a < n)
+            a = n;
+        if (posix_memalign(&base, DHEAP_ALIGN, (a + DHEAP_PAD) * sizeof(dheap_node_t)))
+            return -1;
+        if (s->n)
+            memcpy((dheap_node_t *)base + DHEAP_PAD, s->p, s->n * sizeof(dheap_node_t));
+        free(s->base);
+        s->base = (dheap_node_t *)base;
+        s->p = s->base + DHEAP_PAD;
+        s->a = a;
+    }
+    return 0;
+}
+
+void dheap_shift_up_(dheap_t* s, unsigned hole_index, uint32_t time, timer_entry_t* e)
+{
+    while (hole_index)
+    {
+        unsigned parent = dheap_parent(hole_index);
+        if (s->p[parent].time <= time)
+            break;
+        s->p[hole_index] = s->p[parent];
+        s->p[hole_index].e->min_heap_idx = hole_index;
+        hole_index = parent;
+    }
+    dheap_place_(s, hole_index, time, e);
+}
+
+void dheap_shift_down_(dheap_t* s, unsigned hole_index, uint32_t time, timer_entry_t* e)
+{
+    for (;;)
+    {
+        unsigned child = dheap_first_child(hole_index);
+        unsigned end, min_child, i;
+        if (child >= s->n)
+            break;
+        end = child + DHEAP_D;
+        if (end > s->n)
+            end = s->n;
+        // 同一组孩子在同一条 cache line 上，只比较内联的 time
+        min_child = child;
+        for (i = child + 1; i < end; i++)
+            if (s->p[i].time < s->p[min_child].time)
+                min_child = i;
+        if (s->p[min_child].time >= time)
+            break;
+        s->p[hole_index] = s->p[min_child];
+        s->p[hole_index].e->min_heap_idx = hole_index;
+        hole_index = min_child;
+    }
+    dheap_place_(s, hole_index, time, e);
+}
@@ -0,0 +1,45 @@
+#ifndef MARK_DHEAP_H
+#define MARK_DHEAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "minheap.h"
+
+// d 叉堆，每个结点的孩子数量，取 4 或 8
+#ifndef DHEAP_D
+#define DHEAP_D 4
+#endif
+
+// 过期时间和 entry 指针内联存放，比较时不需要解引用 entry
+typedef struct dheap_node_s {
+    uint32_t time;
+    timer_entry_t *e;
+} dheap_node_t;
+
+// 数组前面预留 DHEAP_D-1 个空位，使得每个结点的一组孩子
+// 都从 DHEAP_D*sizeof(dheap_node_t) 对齐的地址开始，4 叉堆正好一条 cache line
+#define DHEAP_PAD   (DHEAP_D - 1)
+#define DHEAP_ALIGN (DHEAP_D * sizeof(dheap_node_t) > 64 ? DHEAP_D * sizeof(dheap_node_t) : 64)
+
+typedef struct dheap {
+    dheap_node_t *base; // 对齐分配的起始地址
+    dheap_node_t *p;    // base + DHEAP_PAD，堆顶
+    uint32_t n, a; // n 为实际元素个数  a 为容量
+} dheap_t;
+
+void            dheap_ctor_(dheap_t* s);
+void            dheap_dtor_(dheap_t* s);
+int             dheap_empty_(dheap_t* s);
+unsigned        dheap_size_(dheap_t* s);
+timer_entry_t*  dheap_top_(dheap_t* s);
+int             dheap_reserve_(dheap_t* s, unsigned n);
+int             dheap_push_(dheap_t* s, timer_entry_t* e);
+int             dheap_push_bulk_(dheap_t* s, timer_entry_t** es, unsigned k);
+timer_entry_t*  dheap_pop_(dheap_t* s);
+int             dheap_adjust_(dheap_t *s, timer_entry_t* e);
+int             dheap_erase_(dheap_t* s, timer_entry_t* e);
+void            dheap_shift_up_(dheap_t* s, unsigned hole_index, uint32_t time, timer_entry_t* e);
+void            dheap_shift_down_(dheap_t* s, unsigned hole_index, uint32_t time, timer_entry_t* e);
+
+#endif // MARK_DHEAP_H
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "minheap.h"
+#include "dheap.h"
+
+// 对比二叉堆(timer_entry_t* 指针数组)和 d 叉堆(内联 time + 指针)
+// 1M 个定时器: 全部插入 -> 随机删除一半 -> 依次弹出剩余 -> 批量插入
+
+#define BENCH_TIMERS (1000 * 1000)
+
+static uint64_t
+now_ns() {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+// 每个 entry 单独 malloc，和 add_timer 中的内存布局一致
+static timer_entry_t **
+make_entries(int n) {
+    timer_entry_t **es = (timer_entry_t **)malloc(sizeof(*es) * n);
+    int i;
+    srand(1234);
+    for (i = 0; i < n; i++) {
+        es[i] = (timer_entry_t *)malloc(sizeof(timer_entry_t));
+        es[i]->time = (uint32_t)rand();
+        es[i]->min_heap_idx = -1;
+    }
+    return es;
+}
+
+static void
+report(const char *name, const char *op, uint64_t ns, int n) {
+    printf("%-8s %-6s %8.2f ms  %6.1f ns/op\n", name, op, ns / 1e6, (double)ns / n);
+}
+
+static void
+bench_minheap(timer_entry_t **es, int n) {
+    min_heap_t h;
+    uint64_t t;
+    int i;
+    min_heap_ctor_(&h);
+
+    t = now_ns();
+    for (i = 0; i < n; i++)
+        min_heap_push_(&h, es[i]);
+    report("minheap", "push", now_ns() - t, n);
+
+    t = now_ns();
+    for (i = 0; i < n; i += 2)
+        min_heap_erase_(&h, es[i]);
+    report("minheap", "erase", now_ns() - t, n / 2);
+
+    t = now_ns();
+    while (min_heap_pop_(&h));
+    report("minheap", "pop", now_ns() - t, n - n / 2);
+
+    t = now_ns();
+    min_heap_push_bulk_(&h, es, n);
+    report("minheap", "bulk", now_ns() - t, n);
+
+    min_heap_dtor_(&h);
+}
+
+static void
+bench_dheap(timer_entry_t **es, int n) {
+    dheap_t h;
+    uint64_t t;
+    int i;
+    dheap_ctor_(&h);
+
+    t = now_ns();
+    for (i = 0; i < n; i++)
+        dheap_push_(&h, es[i]);
+    report("dheap", "push", now_ns() - t, n);
+
+    t = now_ns();
+    for (i = 0; i < n; i += 2)
+        dheap_erase_(&h, es[i]);
+    report("dheap", "erase", now_ns() - t, n / 2);
+
+    t = now_ns();
+    uint32_t last = 0;
+    timer_entry_t *e;
+    while ((e = dheap_pop_(&h))) {
+        if (e->time < last) {
+            printf("dheap order wrong\n");
+            break;
+        }
+        last = e->time;
+    }
+    report("dheap", "pop", now_ns() - t, n - n / 2);
+
+    t = now_ns();
+    dheap_push_bulk_(&h, es, n);
+    report("dheap", "bulk", now_ns() - t, n);
+
+    dheap_dtor_(&h);
+}
+
+int main(int argc, char *argv[]) {
+    int n = (argc > 1) ? atoi(argv[1]) : BENCH_TIMERS;
+    timer_entry_t **es = make_entries(n);
+
+    printf("timers = %d, d = %d\n", n, DHEAP_D);
+    bench_minheap(es, n);
+    bench_dheap(es, n);
+
+    int i;
+    for (i = 0; i < n; i++)
+        free(es[i]);
+    free(es);
+    return 0;
+}
+
+// gcc -O2 mh-bench.c minheap.c dheap.c -o mh-bench -I./
+// gcc -O2 -DDHEAP_D=8 mh-bench.c minheap.c dheap.c -o mh-bench -I./
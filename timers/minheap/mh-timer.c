@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stddef.h>
 #include <sys/epoll.h>
 #include "mh-timer.h"
 
@@ -7,11 +8,30 @@ void hello_world(timer_entry_t *te) {
     printf("hello world time = %u\n", te->time);
 }
 
+typedef struct conn_s {
+    int fd;
+    timer_entry_t keepalive; // 定时器嵌入到连接中，不需要单独分配
+} conn_t;
+
+void keepalive(timer_entry_t *te) {
+    conn_t *c = (conn_t *)((char *)te - offsetof(conn_t, keepalive));
+    printf("keepalive fd = %d time = %u\n", c->fd, te->time);
+    reset_timer(te, 2000);
+}
+
 int main() {
     init_timer();
 
     add_timer(3000, hello_world);
 
+    uint32_t msecs[3] = {1000, 2000, 3000};
+    timer_entry_t *tes[3];
+    add_timers(msecs, 3, hello_world, tes);
+
+    conn_t conn = { .fd = 1 };
+    timer_entry_init(&conn.keepalive, keepalive);
+    reset_timer(&conn.keepalive, 2000);
+
     int epfd = epoll_create(1);
     struct epoll_event events[512];
 
@@ -26,4 +46,5 @@ int main() {
     return 0;
 }
 
-// gcc mh-timer.c minheap.c -o mh -I./
\ No newline at end of file
+// gcc mh-timer.c minheap.c -o mh -I./
+// gcc -DMH_USE_DHEAP mh-timer.c dheap.c -o mh -I./
\ No newline at end of file
@@ -16,9 +16,58 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// gcc -DMH_USE_DHEAP 切换为 d 叉堆实现(dheap.c)，默认使用二叉堆(minheap.c)
+#if defined(MH_USE_DHEAP)
+#include "dheap.h"
+typedef dheap_t timer_heap_t;
+#define timer_heap_ctor_    dheap_ctor_
+#define timer_heap_top_     dheap_top_
+#define timer_heap_push_    dheap_push_
+#define timer_heap_push_bulk_ dheap_push_bulk_
+#define timer_heap_pop_     dheap_pop_
+#define timer_heap_erase_   dheap_erase_
+#define timer_heap_adjust_  dheap_adjust_
+#else
 #include "minheap.h"
+typedef min_heap_t timer_heap_t;
+#define timer_heap_ctor_    min_heap_ctor_
+#define timer_heap_top_     min_heap_top_
+#define timer_heap_push_    min_heap_push_
+#define timer_heap_push_bulk_ min_heap_push_bulk_
+#define timer_heap_pop_     min_heap_pop_
+#define timer_heap_erase_   min_heap_erase_
+#define timer_heap_adjust_  min_heap_adjust_
+#endif
 
-static min_heap_t min_heap;
+static timer_heap_t min_heap;
+
+// expire_timer 取出的过期定时器先放在这里，再统一回调
+static timer_entry_t **expired;
+static uint32_t expired_cap;
+
+static int
+expired_reserve(uint32_t n) {
+    if (expired_cap < n) {
+        uint32_t cap = expired_cap ? expired_cap * 2 : 64;
+        if (cap < n)
+            cap = n;
+        timer_entry_t **p = (timer_entry_t **)realloc(expired, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        expired = p;
+        expired_cap = cap;
+    }
+    return 0;
+}
+
+// 从待回调数组中摘掉，本轮 expire_timer 不再回调它
+static void
+expired_unlink(timer_entry_t *te) {
+    if (te->expired_slot) {
+        expired[te->expired_slot - 1] = NULL;
+        te->expired_slot = 0;
+    }
+}
 
 static uint32_t
 current_time() {
@@ -38,7 +87,7 @@ current_time() {
 }
 
 void init_timer() {
-    min_heap_ctor_(&min_heap);
+    timer_heap_ctor_(&min_heap);
 }
 
 timer_entry_t * add_timer(uint32_t msec, timer_handler_pt callback) {
@@ -51,7 +100,7 @@ timer_entry_t * add_timer(uint32_t msec, timer_handler_pt callback) {
     te->handler = callback;
     te->time = current_time() + msec;
 
-    if (0 != min_heap_push_(&min_heap, te)) {
+    if (0 != timer_heap_push_(&min_heap, te)) {
         free(te);
         return NULL;
     }
@@ -59,12 +108,58 @@ timer_entry_t * add_timer(uint32_t msec, timer_handler_pt callback) {
     return te;
 }
 
+// 批量添加 n 个定时器，结果写入 tes[0..n)，全部成功返回 0，失败时一个都不添加
+int add_timers(const uint32_t *msec, int n, timer_handler_pt callback, timer_entry_t **tes) {
+    uint32_t now = current_time();
+    int i;
+    for (i = 0; i < n; i++) {
+        tes[i] = (timer_entry_t *)malloc(sizeof(timer_entry_t));
+        if (!tes[i]) {
+            break;
+        }
+        memset(tes[i], 0, sizeof(timer_entry_t));
+        tes[i]->handler = callback;
+        tes[i]->time = now + msec[i];
+    }
+    if (i == n && 0 == timer_heap_push_bulk_(&min_heap, tes, n)) {
+        return 0;
+    }
+    while (i-- > 0) {
+        free(tes[i]);
+        tes[i] = NULL;
+    }
+    return -1;
+}
+
+// 初始化由调用方提供存储的定时器，之后用 reset_timer 启动，不会有内存分配
+void timer_entry_init(timer_entry_t *te, timer_handler_pt callback) {
+    memset(te, 0, sizeof(timer_entry_t));
+    te->handler = callback;
+    te->min_heap_idx = -1;
+    te->embedded = 1;
+}
+
+// 设置定时器 msec 后过期：未启动则加入堆，已在堆中则原地上浮或下沉调整位置
+bool reset_timer(timer_entry_t *te, uint32_t msec) {
+    expired_unlink(te);
+    te->time = current_time() + msec;
+    return 0 == timer_heap_adjust_(&min_heap, te);
+}
+
 bool del_timer(timer_entry_t *e) {
-    return 0 == min_heap_erase_(&min_heap, e);
+    if (e->expired_slot) {
+        expired_unlink(e); // 已过期还没回调的，取消这次回调
+    } else if (0 != timer_heap_erase_(&min_heap, e)) {
+        return false;
+    }
+    if (!e->embedded) {
+        free(e);
+    }
+    return true;
 }
 
 int find_nearest_expire_timer() {
-    timer_entry_t *te = min_heap_top_(&min_heap);
+    timer_entry_t *te = timer_heap_top_(&min_heap);
     if (!te) return -1;
     int diff = (int) te->time - (int)current_time();
     return diff > 0 ? diff : 0;
@@ -72,13 +167,33 @@ int find_nearest_expire_timer() {
 
 void expire_timer() {
     uint32_t cur = current_time();
+    uint32_t i, n = 0;
+    // 先把所有过期的定时器从堆中取出，再统一回调，回调中新加的定时器留到下一轮
     for (;;) {
-        timer_entry_t *te = min_heap_top_(&min_heap);
+        timer_entry_t *te = timer_heap_top_(&min_heap);
         if (!te) break;
         if (te->time > cur) break;
+        if (expired_reserve(n + 1)) break;
+        te = timer_heap_pop_(&min_heap);
+        expired[n++] = te;
+        te->expired_slot = n;
+    }
+    // 前面的回调可能 del_timer 或 reset_timer 了后面的定时器，对应位置已被清空
+    for (i = 0; i < n; i++) {
+        timer_entry_t *te = expired[i];
+        if (!te) continue;
+        if (te->embedded) {
+            // 回调中可能连同宿主对象一起释放，回调之后不再访问
+            te->expired_slot = 0;
+            te->handler(te);
+            continue;
+        }
+        // 回调中 del_timer 或 reset_timer 自己时会清空 expired[i]
         te->handler(te);
-        min_heap_pop_(&min_heap);
-        free(te);
+        if (expired[i]) {
+            te->expired_slot = 0;
+            free(te);
+        }
     }
 }
 
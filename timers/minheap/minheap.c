@@ -30,6 +30,25 @@ timer_entry_t* min_heap_pop_(min_heap_t* s)
     return 0;
 }
 
+/* 批量插入: 新增数量少时逐个上浮 O(k log n)，否则追加到末尾后自底向上建堆 O(n) */
+int min_heap_push_bulk_(min_heap_t* s, timer_entry_t** es, unsigned k)
+{
+    unsigned i;
+    if (min_heap_reserve_(s, s->n + k))
+        return -1;
+    if (k < s->n)
+    {
+        for (i = 0; i < k; i++)
+            min_heap_shift_up_(s, s->n++, es[i]);
+        return 0;
+    }
+    for (i = 0; i < k; i++, s->n++)
+        (s->p[s->n] = es[i])->min_heap_idx = s->n;
+    for (i = s->n / 2; i-- > 0;)
+        min_heap_shift_down_(s, i, s->p[i]);
+    return 0;
+}
+
 int min_heap_elt_is_top_(const timer_entry_t *e)
 {
     return e->min_heap_idx == 0;
@@ -12,6 +12,8 @@ struct timer_entry_s {
     uint32_t min_heap_idx;
     timer_handler_pt handler;
     void *privdata;
+    int embedded; // 1 表示由调用方提供存储(嵌入到连接等对象中)，定时器不负责释放
+    uint32_t expired_slot; // 在 expire_timer 待回调数组中的下标+1，0 表示不在其中
 };
 
 typedef struct min_heap {
@@ -28,6 +30,7 @@ unsigned        min_heap_size_(min_heap_t* s);
 timer_entry_t*  min_heap_top_(min_heap_t* s);
 int             min_heap_reserve_(min_heap_t* s, unsigned n);
 int             min_heap_push_(min_heap_t* s, timer_entry_t* e);
+int             min_heap_push_bulk_(min_heap_t* s, timer_entry_t** es, unsigned k);
 timer_entry_t*  min_heap_pop_(min_heap_t* s);
 int             min_heap_adjust_(min_heap_t *s, timer_entry_t* e);
 int             min_heap_erase_(min_heap_t* s, timer_entry_t* e);
@@ -7,12 +7,31 @@ void hello_world(timer_entry_t *te) {
     printf("hello world time = %u\n", te->rbnode.key);
 }
 
+typedef struct conn_s {
+    int fd;
+    timer_entry_t keepalive; // 定时器嵌入到连接中，不需要单独分配
+} conn_t;
+
+void keepalive(timer_entry_t *te) {
+    conn_t *c = (conn_t *)((char *)te - offsetof(conn_t, keepalive));
+    printf("keepalive fd = %d time = %u\n", c->fd, te->rbnode.key);
+    reset_timer(te, 2000);
+}
+
 int main()
 {
     init_timer();
 
     add_timer(3000, hello_world);
 
+    uint32_t msecs[3] = {1000, 2000, 3000};
+    timer_entry_t *tes[3];
+    add_timers(msecs, 3, hello_world, tes);
+
+    conn_t conn = { .fd = 1 };
+    timer_entry_init(&conn.keepalive, keepalive);
+    reset_timer(&conn.keepalive, 2000);
+
     int epfd = epoll_create(1);
     struct epoll_event events[512];
 
@@ -28,8 +28,63 @@ typedef void (*timer_handler_pt)(timer_entry_t *ev);
 struct timer_entry_s {
     ngx_rbtree_node_t rbnode;
     timer_handler_pt handler;
+    u_char timer_set; // 是否在红黑树中
+    u_char embedded;  // 1 表示由调用方提供存储(嵌入到连接等对象中)，定时器不负责释放
+    ngx_uint_t expired_slot; // 在 expire_timer 待回调数组中的下标+1，0 表示不在其中
 };
 
+#define timer_entry(node) \
+    ((timer_entry_t *) ((char *) (node) - offsetof(timer_entry_t, rbnode)))
+
+static ngx_uint_t           timer_count; // 红黑树中定时器的数量
+
+typedef struct {
+    ngx_rbtree_node_t **nodes;
+    ngx_uint_t          cap;
+} node_array_t;
+
+// expire_timer 摘下的过期节点；add_timers 重建树时的临时数组
+// 分开存放，回调中再调用 add_timers 不会覆盖还没处理的过期节点
+static node_array_t         expired;
+static node_array_t         rebuild;
+
+// 从待回调数组中摘掉，本轮 expire_timer 不再回调它
+static void
+expired_unlink(timer_entry_t *te) {
+    if (te->expired_slot) {
+        expired.nodes[te->expired_slot - 1] = NULL;
+        te->expired_slot = 0;
+    }
+}
+
+static int
+node_array_reserve(node_array_t *a, ngx_uint_t n) {
+    if (a->cap < n) {
+        ngx_uint_t cap = a->cap ? a->cap * 2 : 64;
+        if (cap < n)
+            cap = n;
+        ngx_rbtree_node_t **p = (ngx_rbtree_node_t **)realloc(a->nodes, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        a->nodes = p;
+        a->cap = cap;
+    }
+    return 0;
+}
+
+// 考虑 32 位毫秒回绕的比较，和 ngx_rbtree_insert_timer_value 一致
+static int
+timer_key_cmp(ngx_rbtree_key_t a, ngx_rbtree_key_t b) {
+    ngx_rbtree_key_int_t diff = (ngx_rbtree_key_int_t)(a - b);
+    return diff < 0 ? -1 : (diff > 0 ? 1 : 0);
+}
+
+static int
+timer_entry_cmp(const void *a, const void *b) {
+    return timer_key_cmp((*(timer_entry_t * const *)a)->rbnode.key,
+        (*(timer_entry_t * const *)b)->rbnode.key);
+}
+
 static uint32_t
 current_time() {
 	uint32_t t;
@@ -60,12 +115,90 @@ timer_entry_t* add_timer(uint32_t msec, timer_handler_pt func) {
     printf("add_timer expire at msec = %u\n", msec);
     te->rbnode.key = msec;
     ngx_rbtree_insert(&timer, &te->rbnode);
+    te->timer_set = 1;
+    timer_count++;
     return te;
 }
 
+// 初始化由调用方提供存储的定时器，之后用 reset_timer 启动，不会有内存分配
+void timer_entry_init(timer_entry_t *te, timer_handler_pt func) {
+    memset(te, 0, sizeof(timer_entry_t));
+    te->handler = func;
+    te->embedded = 1;
+}
+
+// 设置定时器 msec 后过期：已在树中则先摘下再按新的 key 插入，节点本身复用
+void reset_timer(timer_entry_t *te, uint32_t msec) {
+    expired_unlink(te);
+    if (te->timer_set) {
+        ngx_rbtree_delete(&timer, &te->rbnode);
+    } else {
+        te->timer_set = 1;
+        timer_count++;
+    }
+    te->rbnode.key = current_time() + msec;
+    ngx_rbtree_insert(&timer, &te->rbnode);
+}
+
+// 批量添加 n 个定时器，结果写入 tes[0..n)，全部成功返回 0，失败时一个都不添加
+// 新增数量不少于已有数量时，把已有节点中序展开后与排好序的新节点归并，再 O(n) 重建整棵树
+int add_timers(const uint32_t *msec, int n, timer_handler_pt func, timer_entry_t **tes) {
+    uint32_t now = current_time();
+    ngx_rbtree_node_t *node, **batch;
+    ngx_uint_t i, j, w, k = (ngx_uint_t)n, total = timer_count + k;
+    for (i = 0; i < k; i++) {
+        tes[i] = (timer_entry_t *)malloc(sizeof(timer_entry_t));
+        if (!tes[i]) {
+            while (i-- > 0) {
+                free(tes[i]);
+                tes[i] = NULL;
+            }
+            return -1;
+        }
+        memset(tes[i], 0, sizeof(timer_entry_t));
+        tes[i]->handler = func;
+        tes[i]->timer_set = 1;
+        tes[i]->rbnode.key = now + msec[i];
+    }
+    if (k < timer_count || node_array_reserve(&rebuild, total)) {
+        for (i = 0; i < k; i++) {
+            ngx_rbtree_insert(&timer, &tes[i]->rbnode);
+        }
+        timer_count = total;
+        return 0;
+    }
+    batch = rebuild.nodes;
+    qsort(tes, k, sizeof(timer_entry_t *), timer_entry_cmp);
+    // 已有节点中序展开到 batch[k, total)，归并结果从 batch[0] 开始写，写的位置不会超过读的位置
+    j = k;
+    if (timer.root != timer.sentinel) {
+        for (node = ngx_rbtree_min(timer.root, timer.sentinel); node;
+             node = ngx_rbtree_next(&timer, node)) {
+            batch[j++] = node;
+        }
+    }
+    for (i = 0, j = k, w = 0; w < total; w++) {
+        if (j < total && (i == k || timer_key_cmp(batch[j]->key, tes[i]->rbnode.key) <= 0)) {
+            batch[w] = batch[j++];
+        } else {
+            batch[w] = &tes[i++]->rbnode;
+        }
+    }
+    ngx_rbtree_build(&timer, batch, total);
+    timer_count = total;
+    return 0;
+}
+
 void del_timer(timer_entry_t *te) {
-    ngx_rbtree_delete(&timer, &te->rbnode);
-    free(te);
+    expired_unlink(te); // 已过期还没回调的，取消这次回调
+    if (te->timer_set) {
+        ngx_rbtree_delete(&timer, &te->rbnode);
+        te->timer_set = 0;
+        timer_count--;
+    }
+    if (!te->embedded) {
+        free(te);
+    }
 }
 
 int find_nearest_expire_timer() {
@@ -80,19 +213,45 @@ int find_nearest_expire_timer() {
 
 void expire_timer() {
     timer_entry_t *te;
-    ngx_rbtree_node_t *sentinel, *root, *node;
+    ngx_rbtree_node_t *sentinel, *node, *next;
+    ngx_rbtree_key_t key;
+    ngx_uint_t i, n = 0;
     sentinel = timer.sentinel;
     uint32_t now = current_time();
-    for (;;) {
-        root = timer.root;
-        if (root == sentinel) break;
-        node = ngx_rbtree_min(root, sentinel);
-        if (node->key > now) break;
-        printf("touch timer expire time=%u, now = %u\n", node->key, now);
-        te = (timer_entry_t *) ((char *) node - offsetof(timer_entry_t, rbnode));
+    if (timer.root == sentinel) return;
+    // 只从根找一次最小节点，之后沿中序后继摘下所有过期节点，再统一回调
+    // 删除的总是当前最小节点，不会移动其他节点，提前取好的后继仍然有效
+    node = ngx_rbtree_min(timer.root, sentinel);
+    while (node && node->key <= now) {
+        if (node_array_reserve(&expired, n + 1)) break;
+        next = ngx_rbtree_next(&timer, node);
+        key = node->key;
+        ngx_rbtree_delete(&timer, node);
+        node->key = key; // ngx_rbtree_delete 会清零 key，回调中还要用
+        te = timer_entry(node);
+        te->timer_set = 0;
+        expired.nodes[n++] = node;
+        te->expired_slot = n;
+        node = next;
+    }
+    timer_count -= n;
+    // 前面的回调可能 del_timer 或 reset_timer 了后面的定时器，对应位置已被清空
+    for (i = 0; i < n; i++) {
+        if (!expired.nodes[i]) continue;
+        te = timer_entry(expired.nodes[i]);
+        printf("touch timer expire time=%u, now = %u\n", te->rbnode.key, now);
+        if (te->embedded) {
+            // 回调中可能连同宿主对象一起释放，回调之后不再访问
+            te->expired_slot = 0;
+            te->handler(te);
+            continue;
+        }
+        // 回调中 del_timer 或 reset_timer 自己时会清空 expired.nodes[i]
         te->handler(te);
-        ngx_rbtree_delete(&timer, &te->rbnode);
-        free(te);
+        if (expired.nodes[i]) {
+            te->expired_slot = 0;
+            free(te);
+        }
     }
 }
 
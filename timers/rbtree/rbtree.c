@@ -18,6 +18,9 @@ static inline void ngx_rbtree_left_rotate(ngx_rbtree_node_t **root,
     ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
 static inline void ngx_rbtree_right_rotate(ngx_rbtree_node_t **root,
     ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
+static ngx_rbtree_node_t *ngx_rbtree_build_subtree(ngx_rbtree_node_t **nodes,
+    ngx_uint_t lo, ngx_uint_t hi, ngx_uint_t depth, ngx_uint_t red_depth,
+    ngx_rbtree_node_t *parent, ngx_rbtree_node_t *sentinel);
 
 
 void
@@ -406,3 +409,58 @@ ngx_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
         node = parent;
     }
 }
+
+
+/*
+ * Bulk-load a tree from nodes sorted by key in O(n), replacing its contents.
+ * Picking the middle node recursively keeps all levels but the last one full,
+ * so the nodes of the last, incomplete level are colored red and the others
+ * black, which satisfies the black-height property.
+ */
+
+void
+ngx_rbtree_build(ngx_rbtree_t *tree, ngx_rbtree_node_t **nodes, ngx_uint_t n)
+{
+    ngx_uint_t  red_depth;
+
+    red_depth = 0;
+
+    while (((ngx_uint_t) 2 << red_depth) - 1 <= n) {
+        red_depth++;
+    }
+
+    tree->root = ngx_rbtree_build_subtree(nodes, 0, n, 0, red_depth, NULL,
+                                          tree->sentinel);
+}
+
+
+static ngx_rbtree_node_t *
+ngx_rbtree_build_subtree(ngx_rbtree_node_t **nodes, ngx_uint_t lo,
+    ngx_uint_t hi, ngx_uint_t depth, ngx_uint_t red_depth,
+    ngx_rbtree_node_t *parent, ngx_rbtree_node_t *sentinel)
+{
+    ngx_uint_t          mid;
+    ngx_rbtree_node_t  *node;
+
+    if (lo == hi) {
+        return sentinel;
+    }
+
+    mid = lo + (hi - lo) / 2;
+    node = nodes[mid];
+
+    node->parent = parent;
+    node->left = ngx_rbtree_build_subtree(nodes, lo, mid, depth + 1,
+                                          red_depth, node, sentinel);
+    node->right = ngx_rbtree_build_subtree(nodes, mid + 1, hi, depth + 1,
+                                           red_depth, node, sentinel);
+
+    if (depth == red_depth) {
+        ngx_rbt_red(node);
+
+    } else {
+        ngx_rbt_black(node);
+    }
+
+    return node;
+}
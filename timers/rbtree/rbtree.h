@@ -61,6 +61,9 @@ ngx_rbtree_node_t *
 ngx_rbtree_next(ngx_rbtree_t *tree,
     ngx_rbtree_node_t *node);
 
+void
+ngx_rbtree_build(ngx_rbtree_t *tree, ngx_rbtree_node_t **nodes, ngx_uint_t n);
+
 #define ngx_rbt_red(node)               ((node)->color = 1)
 #define ngx_rbt_black(node)             ((node)->color = 0)
 #define ngx_rbt_is_red(node)            ((node)->color)
@@ -10,7 +10,23 @@ zskiplistNode *zslCreateNode(int level, unsigned long score, handler_pt func) {
     zskiplistNode *zn =
         malloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
     zn->score = score;
+    zn->seq = 0;
     zn->handler = func;
+    zn->nlevel = level;
+    zn->embedded = 0;
+    zn->linked = 0;
+    return zn;
+}
+
+/* 初始化由调用方提供存储的节点，之后用 zslInsertNode 插入，不会有内存分配 */
+zskiplistNode *zslInitNode(zskiplistTimer *zt, handler_pt func) {
+    zskiplistNode *zn = &zt->node;
+    zn->score = 0;
+    zn->seq = 0;
+    zn->handler = func;
+    zn->nlevel = 0;
+    zn->embedded = 1;
+    zn->linked = 0;
     return zn;
 }
 
@@ -21,51 +37,79 @@ zskiplist *zslCreate(void) {
     zsl = malloc(sizeof(*zsl));
     zsl->level = 1;
     zsl->length = 0;
+    zsl->rng = ZSKIPLIST_SEED;
+    zsl->seq = 0;
+    ATOM_INIT(&zsl->pending, 0);
     zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,defaultHandler);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
         zsl->header->level[j].forward = NULL;
+        zsl->header->level[j].backward = NULL;
     }
     return zsl;
 }
 
+void zslSeed(zskiplist *zsl, uint64_t seed) {
+    zsl->rng = seed ? seed : ZSKIPLIST_SEED; // xorshift 的状态不能为 0
+}
+
 /* Free a whole skiplist. */
 void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->level[0].forward, *next;
+    zskiplistNode *node, *next;
 
+    zslDrain(zsl);
+    node = zsl->header->level[0].forward;
     free(zsl->header);
     while(node) {
         next = node->level[0].forward;
-        free(node);
+        node->linked = 0;
+        if (!node->embedded)
+            free(node);
         node = next;
     }
     free(zsl);
 }
 
-int zslRandomLevel(void) {
+/* xorshift64* */
+static inline uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int randomLevel(uint64_t *state) {
     int level = 1;
-#if defined(__APPLE__)
-    while ((arc4random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-#else
-    while ((rand()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-#endif
+    while ((xorshift64(state)&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
         level += 1;
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
-zskiplistNode *zslInsert(zskiplist *zsl, unsigned long score, handler_pt func) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i, level;
+int zslRandomLevel(zskiplist *zsl) {
+    return randomLevel(&zsl->rng);
+}
 
-    x = zsl->header;
+/* (score, seq) 比较，a 排在 b 之前返回 1 */
+static inline int zslNodeLess(const zskiplistNode *a, const zskiplistNode *b) {
+    return a->score < b->score || (a->score == b->score && a->seq < b->seq);
+}
+
+/* 把已经分配好 level 层的节点 x 链入跳表 */
+static void zslLinkNode(zskiplist *zsl, zskiplistNode *x, int level) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *p;
+    int i;
+
+    x->seq = zsl->seq++;
+    p = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                x->level[i].forward->score < score)
+        while (p->level[i].forward &&
+                zslNodeLess(p->level[i].forward, x))
         {
-            x = x->level[i].forward;
+            p = p->level[i].forward;
         }
-        update[i] = x;
+        update[i] = p;
     }
-    level = zslRandomLevel();
     printf("zskiplist add node level = %d\n", level);
     if (level > zsl->level) {
         for (i = zsl->level; i < level; i++) {
@@ -73,13 +117,38 @@ zskiplistNode *zslInsert(zskiplist *zsl, unsigned long score, handler_pt func) {
         }
         zsl->level = level;
     }
-    x = zslCreateNode(level,score,func);
+    x->nlevel = level;
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
+        x->level[i].backward = update[i];
+        if (x->level[i].forward)
+            x->level[i].forward->level[i].backward = x;
         update[i]->level[i].forward = x;
     }
-
+    x->linked = 1;
     zsl->length++;
+}
+
+zskiplistNode *zslInsert(zskiplist *zsl, unsigned long score, handler_pt func) {
+    int level = zslRandomLevel(zsl);
+    zskiplistNode *x = zslCreateNode(level,score,func);
+    zslLinkNode(zsl, x, level);
+    return x;
+}
+
+/* 插入已有的节点，已经在跳表中的先摘下再按新的 score 插入。
+ * zslCreateNode 分配的节点沿用原来的层数，嵌入式节点最多 ZSKIPLIST_EMBED_LEVEL 层 */
+zskiplistNode *zslInsertNode(zskiplist *zsl, zskiplistNode *x, unsigned long score) {
+    int level = x->nlevel;
+    if (x->linked)
+        zslUnlink(zsl, x);
+    if (x->embedded) {
+        level = zslRandomLevel(zsl);
+        if (level > ZSKIPLIST_EMBED_LEVEL)
+            level = ZSKIPLIST_EMBED_LEVEL;
+    }
+    x->score = score;
+    zslLinkNode(zsl, x, level);
     return x;
 }
 
@@ -89,51 +158,76 @@ zskiplistNode* zslMin(zskiplist *zsl) {
     return x->level[0].forward;
 }
 
-void zslDeleteHead(zskiplist *zsl) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL];
-    zskiplistNode *x = zslMin(zsl);
-    if (!x) return;
+/* 每一层都有前驱指针，直接摘下，不需要从头查找 */
+static void zslDeleteNode(zskiplist *zsl, zskiplistNode *x) {
     int i;
-    for (i = zsl->level-1; i >= 0; i--) {
-        if (zsl->header->level[i].forward == x) {
-            zsl->header->level[i].forward = x->level[i].forward;
-        }
+    for (i = 0; i < x->nlevel; i++) {
+        x->level[i].backward->level[i].forward = x->level[i].forward;
+        if (x->level[i].forward)
+            x->level[i].forward->level[i].backward = x->level[i].backward;
     }
     while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
+    x->linked = 0;
     zsl->length--;
 }
 
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == x) {
-            update[i]->level[i].forward = x->level[i].forward;
-        }
-    }
-    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
-        zsl->level--;
-    zsl->length--;
+void zslDeleteHead(zskiplist *zsl) {
+    zskiplistNode *x = zslMin(zsl);
+    if (!x) return;
+    zslDeleteNode(zsl, x);
+}
+
+/* 从跳表中摘下 zn 本身(不释放)，O(层数) */
+int zslUnlink(zskiplist *zsl, zskiplistNode *zn) {
+    if (!zn->linked)
+        return -1;
+    zslDeleteNode(zsl, zn);
+    return 0;
 }
 
 void zslDelete(zskiplist *zsl, zskiplistNode* zn) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
+    if (zslUnlink(zsl, zn) == 0 && !zn->embedded)
+        free(zn);
+}
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                x->level[i].forward->score < zn->score)
-        {
-            x = x->level[i].forward;
-        }
-        update[i] = x;
+/* 其他线程不能访问跳表的 rng，用线程私有的状态决定层数 */
+zskiplistNode *zslCreateNodeMT(unsigned long score, handler_pt func) {
+    static __thread uint64_t rng;
+    if (!rng)
+        rng = (uint64_t)(uintptr_t)&rng ^ ZSKIPLIST_SEED;
+    return zslCreateNode(randomLevel(&rng), score, func);
+}
+
+/* 任意线程调用，节点还没有链入跳表，借用 level[0].forward 串成栈 */
+void zslPost(zskiplist *zsl, zskiplistNode *x, unsigned long score) {
+    uintptr_t head;
+    x->score = score;
+    do {
+        head = ATOM_LOAD(&zsl->pending);
+        x->level[0].forward = (zskiplistNode *)head;
+    } while (!ATOM_CAS_POINTER(&zsl->pending, head, (uintptr_t)x));
+}
+
+/* 拥有跳表的线程调用，把投递过来的节点按投递顺序插入，返回插入的数量 */
+int zslDrain(zskiplist *zsl) {
+    zskiplistNode *x, *next, *list = NULL;
+    uintptr_t head;
+    int n = 0;
+    do {
+        head = ATOM_LOAD(&zsl->pending);
+    } while (head && !ATOM_CAS_POINTER(&zsl->pending, head, 0));
+    // 栈是后进先出，先反转
+    for (x = (zskiplistNode *)head; x; x = next) {
+        next = x->level[0].forward;
+        x->level[0].forward = list;
+        list = x;
     }
-    x = x->level[0].forward;
-    if (x && zn->score == x->score) {
-        zslDeleteNode(zsl, x, update);
-        free(x);
+    for (x = list; x; x = next, n++) {
+        next = x->level[0].forward;
+        zslInsertNode(zsl, x, x->score);
     }
+    return n;
 }
 
 void zslPrint(zskiplist *zsl) {
@@ -143,7 +237,7 @@ void zslPrint(zskiplist *zsl) {
     printf("start print skiplist level = %d\n", zsl->level);
     int i;
     for (i = 0; i < zsl->length; i++) {
-        printf("skiplist ele %d: score = %lu\n", i+1, x->score);
+        printf("skiplist ele %d: score = %lu seq = %lu\n", i+1, x->score, (unsigned long)x->seq);
         x = x->level[0].forward;
     }
 }
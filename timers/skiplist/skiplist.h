@@ -1,9 +1,15 @@
 #ifndef _MARK_SKIPLIST_
 #define _MARK_SKIPLIST_
 
+#include <stddef.h>
+#include <stdint.h>
+#include "atomic.h"
+
 /* ZSETs use a specialized version of Skiplists */
 #define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^64 elements */
 #define ZSKIPLIST_P 0.25      /* Skiplist P = 1/2 */
+#define ZSKIPLIST_EMBED_LEVEL 12 /* 嵌入式节点的最大层数，P=0.25 时足够 4^12 个元素 */
+#define ZSKIPLIST_SEED 0x9E3779B97F4A7C15ULL /* 默认随机种子，相同的插入序列得到相同的层数 */
 
 typedef struct zskiplistNode zskiplistNode;
 typedef void (*handler_pt) (zskiplistNode *node);
@@ -11,11 +17,15 @@ struct zskiplistNode {
     // sds ele;
     // double score;
     unsigned long score; // 时间戳
+    uint64_t seq;        // 插入序号，score 相同时按插入顺序排列，保证 (score, seq) 唯一
     handler_pt handler;
-     /*struct zskiplistNode *backward; 从后向前遍历时使用*/
+    int nlevel;             // 节点的层数
+    unsigned char embedded; // 1 表示由调用方提供存储，跳表不负责释放
+    unsigned char linked;   // 是否在跳表中
     struct zskiplistLevel {
         struct zskiplistNode *forward;
-        /* unsigned long span; 这个存储的level间节点的个数，在定时器中并不需要*/ 
+        struct zskiplistNode *backward; /* 同一层的前驱，删除时不需要再从头查找 */
+        /* unsigned long span; 这个存储的level间节点的个数，在定时器中并不需要*/
     } level[];
 };
 
@@ -24,14 +34,38 @@ typedef struct zskiplist {
     struct zskiplistNode *header/*, *tail 并不需要知道最后一个节点*/;
     int length;
     int level;
+    uint64_t rng;   // 每个跳表独立的 xorshift 状态，不用 rand() 的全局锁
+    uint64_t seq;
+    ATOM_POINTER pending; // 其他线程投递过来、还没有插入的节点(无锁栈)
 } zskiplist;
 
+/* 可以嵌入到连接等对象中的定时器节点，embed 是 node.level[] 的存储空间 */
+typedef struct zskiplistTimer {
+    zskiplistNode node;
+    struct zskiplistLevel embed[ZSKIPLIST_EMBED_LEVEL];
+} zskiplistTimer;
+
+_Static_assert(offsetof(zskiplistTimer, embed) == offsetof(zskiplistNode, level),
+    "zskiplistTimer.embed must overlay zskiplistNode.level");
+
 zskiplist *zslCreate(void);
+void zslSeed(zskiplist *zsl, uint64_t seed);
 void zslFree(zskiplist *zsl);
+int zslRandomLevel(zskiplist *zsl);
+zskiplistNode *zslCreateNode(int level, unsigned long score, handler_pt func);
 zskiplistNode *zslInsert(zskiplist *zsl, unsigned long score, handler_pt func);
+zskiplistNode *zslInitNode(zskiplistTimer *zt, handler_pt func);
+zskiplistNode *zslInsertNode(zskiplist *zsl, zskiplistNode *x, unsigned long score);
 zskiplistNode* zslMin(zskiplist *zsl);
 void zslDeleteHead(zskiplist *zsl);
-void zslDelete(zskiplist *zsl, zskiplistNode* zn); 
+int zslUnlink(zskiplist *zsl, zskiplistNode *zn);
+void zslDelete(zskiplist *zsl, zskiplistNode* zn);
+
+/* 多线程添加: 任意线程调用 zslPost 把节点压入无锁栈，
+ * 拥有跳表的线程调用 zslDrain 把它们插入跳表 */
+zskiplistNode *zslCreateNodeMT(unsigned long score, handler_pt func);
+void zslPost(zskiplist *zsl, zskiplistNode *x, unsigned long score);
+int zslDrain(zskiplist *zsl);
 
 void zslPrint(zskiplist *zsl);
 #endif
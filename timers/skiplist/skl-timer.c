@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <pthread.h>
 #if defined(__APPLE__)
 #include <AvailabilityMacros.h>
 #include <sys/time.h>
@@ -12,6 +13,7 @@
 #include <time.h>
 #endif
 #include "skiplist.h"
+#include "timer-driver.h"
 
 static uint32_t
 current_time() {
@@ -40,20 +42,50 @@ zskiplistNode *add_timer(zskiplist *zsl, uint32_t msec, handler_pt func) {
     return zslInsert(zsl, msec, func);
 }
 
+// 可以在任意线程调用，节点先投递到无锁栈，由 expire_timer 所在线程插入跳表
+// 返回的节点只能在 expire_timer 所在线程中删除或重置
+zskiplistNode *add_timer_mt(zskiplist *zsl, uint32_t msec, handler_pt func) {
+    msec += current_time();
+    zskiplistNode *zn = zslCreateNodeMT(msec, func);
+    zslPost(zsl, zn, msec);
+    return zn;
+}
+
+// 设置定时器 msec 后过期，节点可以是 add_timer 返回的，也可以是 zslInitNode 初始化的嵌入式节点
+zskiplistNode *reset_timer(zskiplist *zsl, zskiplistNode *zn, uint32_t msec) {
+    return zslInsertNode(zsl, zn, current_time() + msec);
+}
+
 void del_timer(zskiplist *zsl, zskiplistNode *zn) {
     zslDelete(zsl, zn);
 }
 
+// 距离最近一个定时器过期的毫秒数，没有定时器返回 -1
+int find_nearest_expire_timer(zskiplist *zsl) {
+    zskiplistNode *x;
+    zslDrain(zsl);
+    x = zslMin(zsl);
+    if (!x) return -1;
+    int diff = (int)((uint32_t)x->score - current_time());
+    return diff > 0 ? diff : 0;
+}
+
 void expire_timer(zskiplist *zsl) {
     zskiplistNode *x;
+    unsigned char embedded;
     uint32_t now = current_time();
+    zslDrain(zsl);
     for (;;) {
         x = zslMin(zsl);
         if (!x) break;
         if (x->score > now) break;
         printf("touch timer expire time=%lu, now = %u\n", x->score, now);
-        x->handler(x);
         zslDeleteHead(zsl);
+        embedded = x->embedded; // 嵌入式的回调中可能连同宿主一起释放，回调之后不再访问
+        x->handler(x);
+        // add_timer 的节点在回调中用 reset_timer 重新启动了，已经回到跳表里，不能释放
+        if (!embedded && !x->linked)
+            free(x);
     }
 }
 
@@ -61,6 +93,37 @@ void print_hello(zskiplistNode *zn) {
     printf("hello world time = %lu\n", zn->score);
 }
 
+typedef struct conn_s {
+    int fd;
+    zskiplistTimer keepalive; // 定时器嵌入到连接中，不需要单独分配
+} conn_t;
+
+static zskiplist *timer_zsl;
+
+void keepalive(zskiplistNode *zn) {
+    conn_t *c = (conn_t *)((char *)zn - offsetof(conn_t, keepalive.node));
+    printf("keepalive fd = %d time = %lu\n", c->fd, zn->score);
+    reset_timer(timer_zsl, zn, 2000);
+}
+
+static timer_driver_t driver;
+
+static int skl_nearest(void *engine) {
+    return find_nearest_expire_timer((zskiplist *)engine);
+}
+
+static void skl_expire(void *engine) {
+    expire_timer((zskiplist *)engine);
+}
+
+void *producer(void *arg) {
+    zskiplist *zsl = (zskiplist *)arg;
+    add_timer_mt(zsl, 3005, print_hello);
+    add_timer_mt(zsl, 3005, print_hello);
+    timer_driver_notify(&driver);
+    return NULL;
+}
+
 int main()
 {
     zskiplist *zsl = init_timer();
@@ -70,10 +133,24 @@ int main()
     del_timer(zsl, zn);
     add_timer(zsl, 5008, print_hello);
     add_timer(zsl, 7003, print_hello);
-    // zslPrint(zsl);
-    for (;;) {
-        expire_timer(zsl);
-        usleep(10000);
+
+    conn_t conn = { .fd = 1 };
+    timer_zsl = zsl;
+    reset_timer(zsl, zslInitNode(&conn.keepalive, keepalive), 2000);
+
+    reactor_t *r = create_reactor();
+    if (timer_driver_init(&driver, r, zsl, skl_nearest, skl_expire, 0)) {
+        fprintf(stderr, "timer_driver_init failed\n");
+        return 1;
     }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, producer, zsl);
+    pthread_join(tid, NULL);
+    // zslPrint(zsl);
+    // timerfd 在最近的过期时间唤醒 epoll，不再每 10ms 轮询一次
+    eventloop(r);
     return 0;
 }
+
+// gcc skl-timer.c skiplist.c -o skl -I./ -I../../thread_pool -I../timerfd -I../../conn_pool/redis_async -lpthread
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef TD_USE_RBTREE
+#include "rbt-timer.h"
+#define timer_expire_at(te) ((uint32_t)(te)->rbnode.key)
+#else
+#include "mh-timer.h"
+#define timer_expire_at(te) ((te)->time)
+#endif
+#include "timer-driver.h"
+
+// 同一个 timer_driver_t 可以驱动最小堆或红黑树定时器，
+// 跳表和时间轮提供 find_nearest_expire_timer/expire_timer 之后同样可以接入
+
+static timer_driver_t driver;
+static int fired;
+
+static int engine_nearest(void *engine) {
+    return find_nearest_expire_timer();
+}
+
+static void engine_expire(void *engine) {
+    expire_timer();
+}
+
+void hello_world(timer_entry_t *te) {
+    printf("hello world expire = %u now = %u\n", timer_expire_at(te), current_time());
+    if (++fired == 8)
+        stop_eventloop(driver.e.r);
+}
+
+typedef struct conn_s {
+    int fd;
+    timer_entry_t keepalive; // 定时器嵌入到连接中，不需要单独分配
+} conn_t;
+
+void keepalive(timer_entry_t *te) {
+    conn_t *c = (conn_t *)((char *)te - offsetof(conn_t, keepalive));
+    printf("keepalive fd = %d expire = %u now = %u\n", c->fd, timer_expire_at(te), current_time());
+    reset_timer(te, 700);
+}
+
+int main() {
+    init_timer();
+    reactor_t *r = create_reactor();
+    // 10ms 的合并窗口: 相近的定时器在同一次唤醒中处理
+    if (timer_driver_init(&driver, r, NULL, engine_nearest, engine_expire, 10)) {
+        fprintf(stderr, "timer_driver_init failed\n");
+        return 1;
+    }
+
+    uint32_t msecs[6] = {1000, 1003, 1007, 2000, 2500, 3000};
+    timer_entry_t *tes[6];
+    add_timers(msecs, 6, hello_world, tes);
+    add_timer(1500, hello_world);
+    add_timer(3500, hello_world);
+
+    conn_t conn = { .fd = 1 };
+    timer_entry_init(&conn.keepalive, keepalive);
+    reset_timer(&conn.keepalive, 700);
+    // 在 reactor 线程中添加完定时器后重新设置 timerfd
+    timer_driver_update(&driver);
+
+    eventloop(r);
+
+    del_timer(&conn.keepalive);
+    timer_driver_release(&driver);
+    release_reactor(r);
+    return 0;
+}
+
+// gcc td-timer.c ../minheap/minheap.c -o td -I./ -I../minheap -I../../conn_pool/redis_async
+// gcc -DTD_USE_RBTREE td-timer.c ../rbtree/rbtree.c -o td -I./ -I../rbtree -I../../conn_pool/redis_async
@@ -0,0 +1,122 @@
+#ifndef _MARK_TIMER_DRIVER_
+#define _MARK_TIMER_DRIVER_
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+// 用一个 timerfd 驱动任意一种定时器(最小堆/红黑树/跳表/时间轮):
+// timerfd 按最近的过期时间设置绝对时间，注册到 reactor 中，
+// 可读时调用定时器的 expire，然后重新设置 timerfd。
+// 不需要 usleep 轮询，也没有 epoll_wait 毫秒超时的取整误差。
+
+// 距离最近一个定时器过期的毫秒数，没有定时器返回 -1
+typedef int (*timer_nearest_pt)(void *engine);
+// 处理所有已经过期的定时器
+typedef void (*timer_expire_pt)(void *engine);
+
+typedef struct {
+    event_t e;              // 必须放在第一个，reactor 回调时传回的是 &e
+    uint64_t armed;         // 当前 timerfd 设置的到期时间(ms, CLOCK_MONOTONIC)，0 表示未设置
+    uint32_t slack;         // 合并窗口(ms)，到期时间向上取整到 slack 的整数倍，一次唤醒处理一批
+    atomic_int dirty;       // 其他线程添加了定时器，需要重新计算
+    void *engine;
+    timer_nearest_pt nearest;
+    timer_expire_pt expire;
+} timer_driver_t;
+
+static uint64_t
+monotonic_ms() {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+}
+
+static int
+timer_driver_arm(timer_driver_t *d, uint64_t deadline) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    // 全 0 表示取消；否则按绝对时间设置，在毫秒边界上准时唤醒
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    if (deadline && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    if (timerfd_settime(d->e.fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        return -1;
+    d->armed = deadline;
+    return 0;
+}
+
+// 在 reactor 所在线程调用: 添加或删除定时器之后，按最近的过期时间重新设置 timerfd
+void timer_driver_update(timer_driver_t *d) {
+    do {
+        atomic_store(&d->dirty, 0);
+        // 先取时间再取 nearest，跨过毫秒边界时只会提前 1ms 唤醒，不会推迟
+        uint64_t now = monotonic_ms();
+        int diff = d->nearest(d->engine);
+        uint64_t deadline = 0;
+        if (diff >= 0) {
+            deadline = now + diff;
+            if (d->slack > 1)
+                deadline = (deadline + d->slack - 1) / d->slack * d->slack;
+        }
+        if (deadline != d->armed)
+            timer_driver_arm(d, deadline);
+    } while (atomic_load(&d->dirty));
+}
+
+// 任意线程调用: 让 reactor 线程尽快重新计算 timerfd
+// 先置 dirty 再设置 timerfd，和 timer_driver_update 并发时也不会丢失唤醒
+void timer_driver_notify(timer_driver_t *d) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    atomic_store(&d->dirty, 1);
+    its.it_value.tv_nsec = 1; // 相对时间 1ns，立即可读
+    timerfd_settime(d->e.fd, 0, &its, NULL);
+}
+
+static void
+timer_driver_read(int fd, int events, void *privdata) {
+    ((void)events);
+    timer_driver_t *d = (timer_driver_t *)privdata;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    d->armed = 0;
+    d->expire(d->engine);
+    timer_driver_update(d);
+}
+
+int timer_driver_init(timer_driver_t *d, reactor_t *r, void *engine,
+        timer_nearest_pt nearest, timer_expire_pt expire, uint32_t slack) {
+    memset(d, 0, sizeof(*d));
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    d->e.fd = fd;
+    d->e.r = r;
+    d->e.read_fn = timer_driver_read;
+    d->slack = slack;
+    atomic_init(&d->dirty, 0);
+    d->engine = engine;
+    d->nearest = nearest;
+    d->expire = expire;
+    if (add_event(r->epfd, fd, EPOLLIN, &d->e)) {
+        close(fd);
+        return -1;
+    }
+    timer_driver_update(d);
+    return 0;
+}
+
+void timer_driver_release(timer_driver_t *d) {
+    del_event(d->e.r->epfd, d->e.fd);
+    close(d->e.fd);
+}
+
+#endif
@@ -13,9 +13,9 @@
 #include <time.h>
 #endif
 
+// 带哨兵的双向循环链表，节点可以 O(1) 摘下
 typedef struct link_list {
 	timer_node_t head;
-	timer_node_t *tail;
 }link_list_t;
 
 typedef struct timer {
@@ -29,20 +29,42 @@ typedef struct timer {
 
 static s_timer_t * TI = NULL;
 
+static inline void
+link_init(link_list_t *list) {
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+}
+
+// 摘下整条链表，返回以 NULL 结尾的单链表，其中的节点 prev 置为 NULL
 timer_node_t *
 link_clear(link_list_t *list) {
 	timer_node_t * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	timer_node_t * node;
+	if (ret == &list->head)
+		return NULL;
+	for (node = ret; node->next != &list->head; node = node->next)
+		node->prev = NULL;
+	node->prev = NULL;
+	node->next = NULL;
+	link_init(list);
 
 	return ret;
 }
 
 void
 link(link_list_t *list, timer_node_t *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	node->prev = list->head.prev;
+	node->next = &list->head;
+	list->head.prev->next = node;
+	list->head.prev = node;
+}
+
+static inline void
+unlink_node(timer_node_t *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
 }
 
 void
@@ -63,13 +85,23 @@ add_node(s_timer_t *T, timer_node_t *node) {
 	}
 }
 
+void
+timer_node_init(timer_node_t *node, handler_pt func, int threadid) {
+	memset(node, 0, sizeof(*node));
+	node->callback = func;
+	node->id = threadid;
+	node->embedded = 1;
+}
+
 timer_node_t*
 add_timer(int time, handler_pt func, int threadid) {
 	timer_node_t *node = (timer_node_t *)malloc(sizeof(*node));
+	if (!node)
+		return NULL;
+	timer_node_init(node, func, threadid);
+	node->embedded = 0;
 	spinlock_lock(&TI->lock);
 	node->expire = time+TI->time;
-	node->callback = func;
-	node->id = threadid;
 	if (time <= 0) {
 		spinlock_unlock(&TI->lock);
 		node->callback(node);
@@ -81,6 +113,22 @@ add_timer(int time, handler_pt func, int threadid) {
 	return node;
 }
 
+void
+reset_timer(timer_node_t *node, int time) {
+	spinlock_lock(&TI->lock);
+	if (node->prev)
+		unlink_node(node);
+	node->cancel = 0;
+	node->expire = time+TI->time;
+	if (time <= 0) {
+		spinlock_unlock(&TI->lock);
+		node->callback(node);
+		return;
+	}
+	add_node(TI, node);
+	spinlock_unlock(&TI->lock);
+}
+
 void
 move_list(s_timer_t *T, int level, int idx) {
 	timer_node_t *current = link_clear(&T->t[level][idx]);
@@ -120,9 +168,18 @@ dispatch_list(timer_node_t *current) {
 	do {
 		timer_node_t * temp = current;
 		current=current->next;
+		// 嵌入式节点的回调中可能连同宿主一起释放，之后不能再访问
+		uint8_t embedded = temp->embedded;
         if (temp->cancel == 0)
             temp->callback(temp);
-		free(temp);
+		if (!embedded) {
+			// 回调中用 reset_timer 重新启动的节点又挂回时间轮了，不能释放
+			spinlock_lock(&TI->lock);
+			int rearmed = temp->prev != NULL;
+			spinlock_unlock(&TI->lock);
+			if (!rearmed)
+				free(temp);
+		}
 	} while (current);
 }
 
@@ -130,7 +187,7 @@ void
 timer_execute(s_timer_t *T) {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->near[idx].head.next) {
+	while (T->near[idx].head.next != &T->near[idx].head) {
 		timer_node_t *current = link_clear(&T->near[idx]);
 		spinlock_unlock(&T->lock);
 		dispatch_list(current);
@@ -147,9 +204,20 @@ timer_update(s_timer_t *T) {
 	spinlock_unlock(&T->lock);
 }
 
-void
+int
 del_timer(timer_node_t *node) {
-    node->cancel = 1;
+	int removed = 0;
+	spinlock_lock(&TI->lock);
+	if (node->prev) {
+		unlink_node(node);
+		removed = 1;
+	} else {
+		node->cancel = 1;
+	}
+	spinlock_unlock(&TI->lock);
+	if (removed && !node->embedded)
+		free(node);
+	return removed;
 }
 
 s_timer_t *
@@ -158,11 +226,11 @@ timer_create_timer() {
 	memset(r,0,sizeof(*r));
 	int i,j;
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 	spinlock_init(&r->lock);
@@ -188,6 +256,37 @@ gettime() {
 	return t;
 }
 
+// 距离下一个非空 near 槽位的毫秒数；near 为空时返回到下一次 timer_shift 搬移高层链表的毫秒数；
+// 时间轮为空返回 -1。时间轮的精度是 1 个 tick，不需要精确到具体节点
+int
+find_nearest_expire_timer(void) {
+	int i, j, ret = -1;
+	spinlock_lock(&TI->lock);
+	for (i=1; i<TIME_NEAR; i++) {
+		link_list_t *list = &TI->near[(TI->time + i) & TIME_NEAR_MASK];
+		if (list->head.next != &list->head) {
+			ret = i;
+			goto done;
+		}
+	}
+	for (i=0; i<4; i++) {
+		for (j=0; j<TIME_LEVEL; j++) {
+			if (TI->t[i][j].head.next != &TI->t[i][j].head) {
+				ret = TIME_NEAR - (TI->time & TIME_NEAR_MASK);
+				goto done;
+			}
+		}
+	}
+done:
+	spinlock_unlock(&TI->lock);
+	if (ret > 0) {
+		// 时间轮只推进到 current_point，扣掉已经过去的部分
+		uint64_t elapsed = gettime() - TI->current_point;
+		ret = elapsed >= (uint64_t)ret ? 0 : ret - (int)elapsed;
+	}
+	return ret;
+}
+
 void
 expire_timer(void) {
 	uint64_t cp = gettime();
@@ -207,29 +306,28 @@ init_timer(void) {
 	TI->current_point = gettime();
 }
 
+static void
+free_list(link_list_t *list) {
+	timer_node_t* current = link_clear(list);
+	while(current) {
+		timer_node_t * temp = current;
+		current = current->next;
+		if (!temp->embedded)
+			free(temp);
+	}
+}
+
 void
 clear_timer() {
 	int i,j;
+	spinlock_lock(&TI->lock);
 	for (i=0;i<TIME_NEAR;i++) {
-		link_list_t * list = &TI->near[i];
-		timer_node_t* current = list->head.next;
-		while(current) {
-			timer_node_t * temp = current;
-			current = current->next;
-			free(temp);
-		}
-		link_clear(&TI->near[i]);
+		free_list(&TI->near[i]);
 	}
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_list_t * list = &TI->t[i][j];
-			timer_node_t* current = list->head.next;
-			while (current) {
-				timer_node_t * temp = current;
-				current = current->next;
-				free(temp);
-			}
-			link_clear(&TI->t[i][j]);
+			free_list(&TI->t[i][j]);
 		}
 	}
+	spinlock_unlock(&TI->lock);
 }
@@ -15,17 +15,31 @@ typedef void (*handler_pt) (struct timer_node *node);
 
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev; // 挂在时间轮的链表上时不为 NULL
 	uint32_t expire;
     handler_pt callback;
     uint8_t cancel;
+    uint8_t embedded; // 1 表示由调用方提供存储(嵌入到连接等对象中)，时间轮不负责释放
 	int id; // 此时携带参数
 };
 
 timer_node_t* add_timer(int time, handler_pt func, int threadid);
 
+// 初始化由调用方提供存储的定时器节点，之后用 reset_timer 启动，不会有内存分配
+void timer_node_init(timer_node_t *node, handler_pt func, int threadid);
+
+// 设置定时器 time 后过期，已经挂在时间轮上的节点原地摘下重新挂
+// 节点到期后正在等待回调时，只能在它自己的回调中重新启动
+void reset_timer(timer_node_t *node, int time);
+
 void expire_timer(void);
 
-void del_timer(timer_node_t* node);
+// 距离下一次需要调用 expire_timer 的毫秒数，没有定时器返回 -1
+int find_nearest_expire_timer(void);
+
+// 返回 1 表示已从时间轮上摘下；返回 0 表示节点已经到期等待回调，只标记取消，
+// 嵌入式节点要等到回调时机过去之后才能释放
+int del_timer(timer_node_t* node);
 
 void init_timer(void);
 
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include "timewheel.h"
+#include "timer-driver.h"
 
 struct context {
 	int quit;
@@ -17,6 +18,15 @@ struct thread_param {
 };
 
 static struct context ctx = {0};
+static timer_driver_t driver;
+
+static int tw_nearest(void *engine) {
+    return find_nearest_expire_timer();
+}
+
+static void tw_expire(void *engine) {
+    expire_timer();
+}
 
 void do_timer(timer_node_t *node) {
     printf("do_timer expired:%d - thread-id:%d\n", node->expire, node->id);
@@ -30,12 +40,20 @@ void do_clock(timer_node_t *node) {
     add_timer(100, do_clock, node->id);
 }
 
+static timer_node_t heartbeat; // 嵌入式定时器，重复启动不需要 malloc/free
+
+void do_heartbeat(timer_node_t *node) {
+    printf("heartbeat expired:%d\n", node->expire);
+    reset_timer(node, 1000);
+}
+
 void* thread_worker(void *p) {
 	struct thread_param *tp = p;
 	int id = tp->id;
     struct context *ctx = tp->ctx;
     int expire = rand() % 200; 
     add_timer(expire, do_timer, id);
+    timer_driver_notify(&driver); // 其他线程添加的定时器，通知 reactor 线程重新设置 timerfd
 	while (!ctx->quit) {
         usleep(1000);
     }
@@ -45,6 +63,7 @@ void* thread_worker(void *p) {
 
 void do_quit(timer_node_t * node) {
     ctx.quit = 1;
+    stop_eventloop(driver.e.r);
 }
 
 int main() {
@@ -53,8 +72,16 @@ int main() {
     pthread_t pid[ctx.thread];
 
     init_timer();
+    reactor_t *r = create_reactor();
+    // 不再 usleep(250) 轮询，由 timerfd 在最近的过期时间唤醒 epoll
+    if (timer_driver_init(&driver, r, NULL, tw_nearest, tw_expire, 0)) {
+        fprintf(stderr, "timer_driver_init failed\n");
+        exit(1);
+    }
     add_timer(6000, do_quit, 100);
     add_timer(0, do_clock, 100);
+    timer_node_init(&heartbeat, do_heartbeat, 100);
+    reset_timer(&heartbeat, 1000);
     struct thread_param task_thread_p[ctx.thread];
     int i;
     for (i = 0; i < ctx.thread; i++) {
@@ -66,16 +93,17 @@ int main() {
         }
     }
 
-    while (!ctx.quit) {
-        expire_timer();
-        usleep(250);
-    }
+    timer_driver_update(&driver);
+    eventloop(r);
+    del_timer(&heartbeat);
     clear_timer();
     for (i = 0; i < ctx.thread; i++) {
 		pthread_join(pid[i], NULL);
     }
+    timer_driver_release(&driver);
+    release_reactor(r);
     printf("all thread is closed\n");
     return 0;
 }
 
-// gcc tw-timer.c timewheel.c -o tw -I./ -lpthread 
\ No newline at end of file
+// gcc tw-timer.c timewheel.c -o tw -I./ -I../../thread_pool -I../timerfd -I../../conn_pool/redis_async -lpthread
\ No newline at end of file